@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A read-only memory mapping of a whole file
+ * The mapping is shared through the page cache by all processes mapping the same file
+ * Pages are read on first access, so opening costs O(1) whatever the size
+ */
+class MappedFile {
+private:
+    void* address = MAP_FAILED;
+    size_t length = 0;
+
+public:
+    /**
+     * @throw std::runtime_error if the file can not be opened or mapped
+     * @param path
+     */
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("can not open " + path);
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("can not stat " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        address = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            throw std::runtime_error("can not map " + path);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& that) noexcept: address(that.address), length(that.length) {
+        that.address = MAP_FAILED;
+        that.length = 0;
+    }
+
+    ~MappedFile() {
+        if (address != MAP_FAILED) {
+            ::munmap(address, length);
+        }
+    }
+
+    const char* data() const {
+        return static_cast<const char*>(address);
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    /**
+     * Hint the kernel that the mapping will be read once from the beginning to the end
+     */
+    void adviseSequential() const {
+        ::madvise(address, length, MADV_SEQUENTIAL);
+    }
+
+    /**
+     * Hint the kernel that the mapping will be read at random places, so that read-ahead
+     * does not load unused pages
+     */
+    void adviseRandom() const {
+        ::madvise(address, length, MADV_RANDOM);
+    }
+};
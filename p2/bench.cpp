@@ -0,0 +1,363 @@
+// YCSB-style workload benchmark of HashTable against std::unordered_map
+// usage: ./bench [--mix=READ,INSERT,UPDATE,ERASE] [--dist=uniform|zipf] [--theta=0.99]
+//                [--key=int|u64|str16|str128] [--hash=std|fast] [--records=N,N,...]
+//                [--ops=N] [--max-records=N] [--seed=N]
+// e.g. YCSB-A is --mix=50,0,50,0 --dist=zipf, YCSB-C is --mix=100,0,0,0 --dist=zipf
+// Without --records, table sizes range from L1-resident to 10x the last level cache
+// Latency percentiles are sampled over one operation in 64, throughput covers all of them
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include "hashers.hpp"
+#include "hashtable.hpp"
+
+// bytes held by live allocations (as reported by malloc), to measure bytes per entry
+static size_t g_live_bytes = 0;
+// length of the string keys, shorter keys are padded
+static size_t g_key_length = 16;
+
+void* operator new(size_t size) {
+    void* p = std::malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    g_live_bytes += malloc_usable_size(p);
+    return p;
+}
+
+// not inlined, so that the compiler does not pair the free with a built-in operator new
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if (p) {
+        g_live_bytes -= malloc_usable_size(p);
+        std::free(p);
+    }
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+struct Options {
+    unsigned mix[4] = { 50, 0, 50, 0 }; // percentages of read, insert, update, erase
+    bool zipf = false;
+    double theta = 0.99;
+    std::string key = "u64";
+    std::string hash = "std";
+    std::vector<size_t> records;
+    size_t ops = 1000000;
+    size_t maxRecords = 1ul << 24;
+    uint64_t seed = 2810;
+};
+
+enum Operation { READ, INSERT, UPDATE, ERASE };
+
+/**
+ * The scrambled Zipfian generator of YCSB (Gray et al., "Quickly generating billion-record
+ * synthetic databases"), item popularity is spread over the key space by a hash
+ */
+class Zipfian {
+private:
+    size_t items;
+    double theta, alpha, zetan, eta;
+
+    static double zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; i++) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    Zipfian(size_t items, double theta): items(items), theta(theta) {
+        alpha = 1 / (1 - theta);
+        zetan = zeta(items, theta);
+        double zeta2 = zeta(2, theta);
+        eta = (1 - std::pow(2.0 / static_cast<double>(items), 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template<typename Random>
+    size_t operator()(Random& random) {
+        double u = std::uniform_real_distribution<double>(0, 1)(random);
+        double uz = u * zetan;
+        size_t rank;
+        if (uz < 1) {
+            rank = 0;
+        } else if (uz < 1 + std::pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = static_cast<size_t>(
+                static_cast<double>(items) * std::pow(eta * u - eta + 1, alpha)
+            );
+        }
+        return HashFunction::mix64(std::min(rank, items - 1)) % items;
+    }
+};
+
+template<typename Key>
+Key makeKey(uint64_t id);
+
+template<>
+int makeKey<int>(uint64_t id) {
+    return static_cast<int>(HashFunction::mix64(id));
+}
+
+template<>
+uint64_t makeKey<uint64_t>(uint64_t id) {
+    return HashFunction::mix64(id);
+}
+
+template<>
+std::string makeKey<std::string>(uint64_t id) {
+    std::string key = "user" + std::to_string(HashFunction::mix64(id));
+    key.resize(g_key_length, '#');
+    return key;
+}
+
+// adapters giving both tables the same interface
+template<typename Key, typename Hash>
+struct HashTableAdapter {
+    static constexpr const char* NAME = "HashTable";
+    HashTable<Key, uint64_t, Hash> table;
+
+    bool read(const Key& key) {
+        return table.contains(key);
+    }
+
+    void write(const Key& key, uint64_t value) {
+        table.insert(key, value);
+    }
+
+    void erase(const Key& key) {
+        table.erase(key);
+    }
+};
+
+template<typename Key, typename Hash>
+struct UnorderedMapAdapter {
+    static constexpr const char* NAME = "unordered_map";
+    std::unordered_map<Key, uint64_t, Hash> table;
+
+    bool read(const Key& key) {
+        return table.find(key) != table.end();
+    }
+
+    void write(const Key& key, uint64_t value) {
+        table[key] = value;
+    }
+
+    void erase(const Key& key) {
+        table.erase(key);
+    }
+};
+
+/**
+ * Load the table with the given records, then run the operations one by one
+ * Operations and keys are generated before timing, so only the table is measured
+ * Only one operation in LATENCY_SAMPLE is timed on its own, so that the clock reads barely
+ * weigh on the throughput of the loop
+ */
+template<typename Table, typename Key>
+void run(size_t records, const std::vector<Operation>& ops, const std::vector<Key>& keys) {
+    typedef std::chrono::steady_clock Clock;
+    constexpr size_t LATENCY_SAMPLE = 64;
+    size_t before = g_live_bytes;
+    auto table = new Table();
+    for (size_t i = 0; i < records; i++) {
+        table->write(makeKey<Key>(i), i);
+    }
+    double bytesPerEntry =
+        static_cast<double>(g_live_bytes - before) / static_cast<double>(records);
+
+    std::vector<uint32_t> latency;
+    latency.reserve(ops.size() / LATENCY_SAMPLE + 1);
+    size_t hits = 0;
+    auto apply = [&](size_t i) {
+        switch (ops[i]) {
+            case READ:
+                hits += table->read(keys[i]);
+                break;
+            case INSERT:
+            case UPDATE:
+                table->write(keys[i], i);
+                break;
+            case ERASE:
+                table->erase(keys[i]);
+                break;
+        }
+    };
+    auto start = Clock::now();
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (i % LATENCY_SAMPLE != 0) {
+            apply(i);
+            continue;
+        }
+        auto opStart = Clock::now();
+        apply(i);
+        latency.push_back(static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - opStart).count()
+        ));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    delete table;
+
+    std::sort(latency.begin(), latency.end());
+    auto percentile = [&latency](double p) {
+        return latency[std::min(latency.size() - 1, static_cast<size_t>(p * static_cast<double>(latency.size())))];
+    };
+    std::cout << std::left << std::setw(15) << Table::NAME << std::right << std::setw(11) << records
+              << std::setw(10) << std::fixed << std::setprecision(1) << bytesPerEntry
+              << std::setw(10) << std::setprecision(2)
+              << static_cast<double>(ops.size()) / seconds / 1e6 << std::setw(8) << percentile(0.5)
+              << std::setw(8) << percentile(0.9) << std::setw(8) << percentile(0.99) << std::setw(9)
+              << percentile(0.999) << std::setw(12) << hits << std::endl;
+}
+
+template<typename Key, typename Hash>
+void runSize(const Options& options, size_t records) {
+    std::mt19937_64 random(options.seed);
+    std::vector<Operation> ops(options.ops);
+    std::vector<Key> keys(options.ops);
+    Zipfian zipfian(options.zipf ? records : 2, options.theta);
+    std::uniform_int_distribution<size_t> uniform(0, records - 1);
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+    uint64_t nextId = records;
+    for (size_t i = 0; i < options.ops; i++) {
+        unsigned r = percent(random);
+        unsigned op = 0;
+        while (op < 3 && r >= options.mix[op]) {
+            r -= options.mix[op];
+            ++op;
+        }
+        ops[i] = static_cast<Operation>(op);
+        uint64_t id = ops[i] == INSERT ? nextId++ : options.zipf ? zipfian(random) : uniform(random);
+        keys[i] = makeKey<Key>(id);
+    }
+    run<HashTableAdapter<Key, Hash>>(records, ops, keys);
+    run<UnorderedMapAdapter<Key, Hash>>(records, ops, keys);
+}
+
+template<typename Key>
+void runAll(const Options& options, const std::vector<size_t>& sizes) {
+    for (size_t records: sizes) {
+        if (options.hash == "fast") {
+            runSize<Key, HashFunction::Fast<Key>>(options, records);
+        } else {
+            runSize<Key, std::hash<Key>>(options, records);
+        }
+    }
+}
+
+/**
+ * @return table sizes from L1-resident to 10x the last level cache
+ */
+std::vector<size_t> defaultSizes(const Options& options) {
+    constexpr size_t ENTRY_BYTES = 64; // rough footprint of an entry, measured by the run
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE), l2 = sysconf(_SC_LEVEL2_CACHE_SIZE),
+         llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    l1 = l1 > 0 ? l1 : 32 << 10;
+    l2 = l2 > 0 ? l2 : 1 << 20;
+    llc = llc > 0 ? llc : 32 << 20;
+    std::vector<size_t> sizes;
+    for (long bytes: { l1 / 2, l2 / 2, llc / 2, llc * 2, llc * 10 }) {
+        size_t records = static_cast<size_t>(bytes) / ENTRY_BYTES;
+        if (records > options.maxRecords) {
+            std::cerr << "skipping " << records << " records, raise --max-records to run it"
+                      << std::endl;
+            continue;
+        }
+        sizes.push_back(records);
+    }
+    return sizes;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        std::istringstream in(value);
+        char comma;
+        if (name == "--mix") {
+            in >> options.mix[0] >> comma >> options.mix[1] >> comma >> options.mix[2] >> comma
+                >> options.mix[3];
+        } else if (name == "--dist") {
+            options.zipf = value == "zipf";
+        } else if (name == "--theta") {
+            in >> options.theta;
+        } else if (name == "--key") {
+            options.key = value;
+        } else if (name == "--hash") {
+            options.hash = value;
+        } else if (name == "--records") {
+            for (size_t records; in >> records; in >> comma) {
+                options.records.push_back(records);
+            }
+        } else if (name == "--ops") {
+            in >> options.ops;
+        } else if (name == "--max-records") {
+            in >> options.maxRecords;
+        } else if (name == "--seed") {
+            in >> options.seed;
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (options.mix[0] + options.mix[1] + options.mix[2] + options.mix[3] != 100) {
+        std::cerr << "--mix must add up to 100" << std::endl;
+        return 1;
+    }
+    // alpha = 1 / (1 - theta) of the Zipfian generator is only finite below 1
+    if (!(options.theta >= 0 && options.theta < 1)) {
+        std::cerr << "--theta must be in [0, 1)" << std::endl;
+        return 1;
+    }
+    if (options.ops == 0) {
+        std::cerr << "--ops must be positive" << std::endl;
+        return 1;
+    }
+    for (size_t records: options.records) {
+        if (records == 0) {
+            std::cerr << "--records must be positive" << std::endl;
+            return 1;
+        }
+    }
+    auto sizes = options.records.empty() ? defaultSizes(options) : options.records;
+
+    std::cout << "mix " << options.mix[0] << "/" << options.mix[1] << "/" << options.mix[2] << "/"
+              << options.mix[3] << " (read/insert/update/erase), "
+              << (options.zipf ? "zipf" : "uniform") << ", key " << options.key << ", hash "
+              << options.hash << ", " << options.ops << " ops" << std::endl;
+    std::cout << std::left << std::setw(15) << "table" << std::right << std::setw(11) << "records"
+              << std::setw(10) << "B/entry" << std::setw(10) << "Mops/s" << std::setw(8) << "p50ns"
+              << std::setw(8) << "p90ns" << std::setw(8) << "p99ns" << std::setw(9) << "p999ns"
+              << std::setw(12) << "read hits" << std::endl;
+    if (options.key == "int") {
+        runAll<int>(options, sizes);
+    } else if (options.key == "u64") {
+        runAll<uint64_t>(options, sizes);
+    } else if (options.key == "str16" || options.key == "str128") {
+        g_key_length = options.key == "str16" ? 16 : 128;
+        runAll<std::string>(options, sizes);
+    } else {
+        std::cerr << "unknown key type " << options.key << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// compare the hash functions of hashers.hpp with std::hash inside HashTable
+// usage: ./hash_bench [number of keys]
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hashers.hpp"
+#include "hashtable.hpp"
+
+/**
+ * Insert all keys into a fresh table (sized once), then look every key up
+ * Prints insert and lookup throughput along with the chain statistics
+ */
+template<typename Key, typename Hash>
+void run(const std::string& keySet, const std::string& hasher, const std::vector<Key>& keys) {
+    typedef std::chrono::steady_clock Clock;
+    HashTable<Key, size_t, Hash> table;
+    table.reserve(keys.size());
+    auto start = Clock::now();
+    for (size_t i = 0; i < keys.size(); i++) {
+        table.insert(keys[i], i);
+    }
+    double insertSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    start = Clock::now();
+    size_t found = 0;
+    for (auto& key: keys) {
+        found += table.contains(key);
+    }
+    double findSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (found != table.size()) {
+        std::cerr << "lookup mismatch" << std::endl;
+        std::exit(1);
+    }
+    auto stats = table.stats();
+    std::cout << std::left << std::setw(16) << keySet << std::setw(12) << hasher << std::right
+              << std::setw(10) << std::fixed << std::setprecision(2)
+              << static_cast<double>(keys.size()) / insertSeconds / 1e6 << std::setw(10)
+              << static_cast<double>(keys.size()) / findSeconds / 1e6 << std::setw(10)
+              << stats.maxChainLength << std::setw(10) << std::setprecision(3)
+              << stats.emptyBucketRatio << std::setw(12) << stats.collisionScore << std::endl;
+}
+
+template<typename Key>
+void runAll(const std::string& keySet, const std::vector<Key>& keys) {
+    run<Key, std::hash<Key>>(keySet, "std::hash", keys);
+    run<Key, HashFunction::Fast<Key>>(keySet, "Fast", keys);
+    run<Key, HashFunction::Randomized<Key>>(keySet, "Randomized", keys);
+}
+
+int main(int argc, char* argv[]) {
+    size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+
+    std::cout << std::left << std::setw(16) << "keys" << std::setw(12) << "hash" << std::right
+              << std::setw(10) << "Mins/s" << std::setw(10) << "Mfind/s" << std::setw(10)
+              << "maxChain" << std::setw(10) << "empty" << std::setw(12) << "collision" << std::endl;
+
+    std::vector<uint64_t> sequential(n);
+    for (size_t i = 0; i < n; i++) {
+        sequential[i] = i;
+    }
+    runAll("sequential", sequential);
+
+    // multiples of the bucket size the table will use, all in one chain under std::hash
+    // kept smaller since the identity hash makes this quadratic
+    HashTable<uint64_t, size_t> probe;
+    probe.reserve(n / 10);
+    std::vector<uint64_t> strided(n / 10);
+    for (size_t i = 0; i < strided.size(); i++) {
+        strided[i] = i * probe.bucketSize();
+    }
+    runAll("bucket-strided", strided);
+
+    std::vector<std::string> shortStrings(n), longStrings(n / 10);
+    for (size_t i = 0; i < n; i++) {
+        shortStrings[i] = "user:" + std::to_string(i);
+    }
+    for (size_t i = 0; i < longStrings.size(); i++) {
+        longStrings[i] = std::string(1000, 'x') + std::to_string(i);
+    }
+    runAll("short-string", shortStrings);
+    runAll("long-string", longStrings);
+    return 0;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+// hash functions for HashTable, in the style of wyhash (short keys) and XXH3 (long keys)
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #include <immintrin.h>
+    #define HASH_FUNCTION_X86 1
+#endif
+
+namespace HashFunction {
+    static constexpr uint64_t P0 = 0xa0761d6478bd642full;
+    static constexpr uint64_t P1 = 0xe7037ed1a0b428dbull;
+    static constexpr uint64_t P2 = 0x8ebc6af09c88c6e3ull;
+    static constexpr uint64_t P3 = 0x589965cc75374cc3ull;
+    static constexpr uint64_t PRIME32 = 0x9e3779b1ull;
+
+    static constexpr size_t STRIPE = 64; // bytes consumed by one accumulation step of a long key
+    static constexpr size_t STRIPES_PER_BLOCK = 16; // stripes between two scrambles
+    static constexpr size_t LONG_KEY = 256; // keys longer than this use the striped path
+
+    /**
+     * 64x64 -> 128 bit multiplication, folded to 64 bits
+     * Time Complexity: O(1)
+     */
+    inline uint64_t mum(uint64_t a, uint64_t b) {
+        __uint128_t r = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+    }
+
+    /**
+     * A strong bijective integer mixer (the splitmix64 finalizer)
+     * Every input bit affects every output bit, so structured keys (sequential IDs,
+     * multiples of the bucket size) are spread uniformly over the buckets
+     * Time Complexity: O(1)
+     */
+    inline uint64_t mix64(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    inline uint64_t read64(const unsigned char* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t read32(const unsigned char* p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    /**
+     * wyhash-style hash of a short key
+     * Time Complexity: O(len)
+     */
+    inline uint64_t hashShort(const unsigned char* p, size_t len, uint64_t seed) {
+        uint64_t a, b;
+        seed ^= mum(seed ^ P0, P1);
+        if (len <= 16) {
+            if (len >= 4) {
+                size_t shift = (len >> 3) << 2;
+                a = (read32(p) << 32) | read32(p + shift);
+                b = (read32(p + len - 4) << 32) | read32(p + len - 4 - shift);
+            } else if (len > 0) {
+                a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8)
+                    | p[len - 1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if (i > 48) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+                    see1 = mum(read64(p + 16) ^ P2, read64(p + 24) ^ see1);
+                    see2 = mum(read64(p + 32) ^ P3, read64(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16) {
+                seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+                i -= 16;
+                p += 16;
+            }
+            a = read64(p + i - 16);
+            b = read64(p + i - 8);
+        }
+        __uint128_t r = static_cast<__uint128_t>(a ^ P1) * (b ^ seed);
+        return mum(static_cast<uint64_t>(r) ^ P0 ^ len, static_cast<uint64_t>(r >> 64) ^ P1);
+    }
+
+    /**
+     * XXH3-style accumulation of full stripes, portable version
+     * acc[lane ^ 1] += data, acc[lane] += lo32(data ^ key) * hi32(data ^ key)
+     * After every STRIPES_PER_BLOCK stripes the accumulators are scrambled
+     * Time Complexity: O(stripes)
+     */
+    inline void accumulateScalar(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) {
+        for (size_t s = 0; s < stripes; s++, p += STRIPE) {
+            for (size_t lane = 0; lane < 8; lane++) {
+                uint64_t data = read64(p + lane * 8);
+                uint64_t dataKey = data ^ key[lane];
+                acc[lane ^ 1] += data;
+                acc[lane] += (dataKey & 0xffffffffull) * (dataKey >> 32);
+            }
+            if ((s + 1) % STRIPES_PER_BLOCK == 0) {
+                for (size_t lane = 0; lane < 8; lane++) {
+                    acc[lane] = ((acc[lane] ^ (acc[lane] >> 47)) ^ key[lane]) * PRIME32;
+                }
+            }
+        }
+    }
+
+#ifdef HASH_FUNCTION_X86
+    /**
+     * AVX2 version of accumulateScalar, with identical results
+     */
+    __attribute__((target("avx2"))) inline void
+    accumulateAvx2(uint64_t* acc, const unsigned char* p, size_t stripes, const uint64_t* key) {
+        __m256i acc0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc));
+        __m256i acc1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + 4));
+        const __m256i key0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key));
+        const __m256i key1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + 4));
+        const __m256i prime = _mm256_set1_epi64x(static_cast<long long>(PRIME32));
+        for (size_t s = 0; s < stripes; s++, p += STRIPE) {
+            __m256i data0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i data1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+            __m256i dataKey0 = _mm256_xor_si256(data0, key0);
+            __m256i dataKey1 = _mm256_xor_si256(data1, key1);
+            // swap the two 64-bit halves of each 128-bit lane, i.e. lane ^ 1
+            acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(data0, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(data1, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(dataKey0, _mm256_srli_epi64(dataKey0, 32)));
+            acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(dataKey1, _mm256_srli_epi64(dataKey1, 32)));
+            if ((s + 1) % STRIPES_PER_BLOCK == 0) {
+                acc0 = _mm256_xor_si256(_mm256_xor_si256(acc0, _mm256_srli_epi64(acc0, 47)), key0);
+                acc1 = _mm256_xor_si256(_mm256_xor_si256(acc1, _mm256_srli_epi64(acc1, 47)), key1);
+                // 64-bit by 32-bit multiplication from two 32x32 -> 64 products
+                acc0 = _mm256_add_epi64(
+                    _mm256_mul_epu32(acc0, prime),
+                    _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(acc0, 32), prime), 32)
+                );
+                acc1 = _mm256_add_epi64(
+                    _mm256_mul_epu32(acc1, prime),
+                    _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(acc1, 32), prime), 32)
+                );
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), acc0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + 4), acc1);
+    }
+#endif
+
+    /**
+     * @return whether the AVX2 accumulation can be used on this CPU, checked once
+     */
+    inline bool hasAvx2() {
+#ifdef HASH_FUNCTION_X86
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Hash a byte string
+     * Keys up to LONG_KEY bytes use the wyhash-style path, longer keys are accumulated
+     * 64 bytes at a time (vectorized with AVX2 if available) and the tail is hashed
+     * with the short path, seeded by the folded accumulators
+     * Time Complexity: O(len)
+     */
+    inline uint64_t hashBytes(const void* data, size_t len, uint64_t seed = 0) {
+        auto p = static_cast<const unsigned char*>(data);
+        if (len <= LONG_KEY) {
+            return hashShort(p, len, seed);
+        }
+        uint64_t key[8], acc[8];
+        for (size_t lane = 0; lane < 8; lane++) {
+            key[lane] = mix64(seed + (lane + 1) * P0);
+            acc[lane] = key[lane] ^ P2;
+        }
+        size_t stripes = len / STRIPE;
+#ifdef HASH_FUNCTION_X86
+        if (hasAvx2()) {
+            accumulateAvx2(acc, p, stripes, key);
+        } else {
+            accumulateScalar(acc, p, stripes, key);
+        }
+#else
+        accumulateScalar(acc, p, stripes, key);
+#endif
+        uint64_t h = len * P0;
+        for (size_t lane = 0; lane < 8; lane += 2) {
+            h += mum(acc[lane] ^ P1, acc[lane + 1] ^ P3);
+        }
+        return hashShort(p + stripes * STRIPE, len - stripes * STRIPE, h);
+    }
+
+    /**
+     * @return a fresh unpredictable seed, different for every call
+     */
+    inline uint64_t randomSeed() {
+        static const uint64_t base = (static_cast<uint64_t>(std::random_device()()) << 32)
+                                     ^ std::random_device()();
+        static std::atomic<uint64_t> counter { 0 };
+        return mix64(base + (++counter) * P0);
+    }
+
+    /**
+     * Fast hash function object, a drop-in replacement of std::hash for HashTable
+     * Supports integers, enums, pointers, std::string and std::string_view
+     * With the default seed 0 it is deterministic across processes (HashTable::save can be used)
+     * @tparam Key
+     */
+    template<typename Key, typename Enable = void>
+    struct Fast;
+
+    template<typename Key>
+    struct Fast<
+        Key,
+        typename std::enable_if<
+            std::is_integral<Key>::value || std::is_enum<Key>::value || std::is_pointer<Key>::value>::type> {
+        uint64_t seed = 0;
+
+        Fast() = default;
+
+        explicit Fast(uint64_t seed): seed(seed) {}
+
+        size_t operator()(Key key) const {
+            uint64_t x;
+            if constexpr (std::is_pointer<Key>::value) {
+                x = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+            } else {
+                x = static_cast<uint64_t>(key);
+            }
+            return static_cast<size_t>(mix64(x + seed));
+        }
+    };
+
+    template<typename Key>
+    struct Fast<
+        Key,
+        typename std::enable_if<
+            std::is_same<Key, std::string>::value || std::is_same<Key, std::string_view>::value>::type> {
+        uint64_t seed = 0;
+
+        Fast() = default;
+
+        explicit Fast(uint64_t seed): seed(seed) {}
+
+        size_t operator()(std::string_view key) const {
+            return static_cast<size_t>(hashBytes(key.data(), key.size(), seed));
+        }
+    };
+
+    /**
+     * Fast with a random seed drawn for every instance
+     * Keys crafted to collide under one seed are spread under another, so an attacker
+     * who can choose keys can not force long chains
+     * The hash values differ between processes, do not save a HashTable using it
+     * @tparam Key
+     */
+    template<typename Key>
+    struct Randomized: Fast<Key> {
+        Randomized(): Fast<Key>(randomSeed()) {}
+    };
+}
@@ -1,13 +1,145 @@
+#include "../common/mapped_file.hpp"
 #include "hash_prime.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <exception>
 #include <forward_list>
+#include <fstream>
 #include <functional>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include <stdexcept>
 // #include <iostream>
 
+/**
+ * A snapshot of the statistics of a hashtable, returned by HashTable::stats
+ * The structural fields (chain lengths, empty buckets, collision score) are always computed
+ * The probe and rehash fields are only meaningful if collected is true
+ */
+struct HashTableStats {
+    size_t size = 0; // number of elements
+    size_t bucketSize = 0; // number of buckets
+    double loadFactor = 0; // current load factor
+    double maxLoadFactor = 0; // maximum load factor
+    std::vector<size_t> chainLengthHistogram; // [l] is the number of buckets with chain length l
+    size_t maxChainLength = 0; // length of the longest chain
+    double emptyBucketRatio = 0; // ratio of buckets with no element
+    // sum of squared chain lengths divided by its expectation under uniform hashing
+    // 1.0 for an ideal hash function, much larger if keys pile into a few chains
+    double collisionScore = 1;
+
+    bool collected = false; // whether the counters below are collected
+    size_t hitCount = 0; // number of lookups that found the key
+    size_t missCount = 0; // number of lookups that did not find the key
+    size_t hitProbeMax = 0; // maximum number of key comparisons of a hit
+    size_t missProbeMax = 0; // maximum number of key comparisons of a miss
+    double hitProbeAvg = 0; // average number of key comparisons of a hit
+    double missProbeAvg = 0; // average number of key comparisons of a miss
+    size_t rehashCount = 0; // number of rehashes that changed the bucket size
+    double rehashSeconds = 0; // cumulative time spent in these rehashes
+
+    /**
+     * Time Complexity: O(length of the longest chain)
+     * @return the statistics as a single JSON object
+     */
+    std::string toJson() const {
+        std::ostringstream out;
+        out << "{\"size\":" << size << ",\"bucketSize\":" << bucketSize
+            << ",\"loadFactor\":" << loadFactor << ",\"maxLoadFactor\":" << maxLoadFactor
+            << ",\"chainLengthHistogram\":[";
+        for (size_t i = 0; i < chainLengthHistogram.size(); i++) {
+            out << (i ? "," : "") << chainLengthHistogram[i];
+        }
+        out << "],\"maxChainLength\":" << maxChainLength
+            << ",\"emptyBucketRatio\":" << emptyBucketRatio
+            << ",\"collisionScore\":" << collisionScore;
+        if (collected) {
+            out << ",\"hitCount\":" << hitCount << ",\"missCount\":" << missCount
+                << ",\"hitProbeMax\":" << hitProbeMax << ",\"missProbeMax\":" << missProbeMax
+                << ",\"hitProbeAvg\":" << hitProbeAvg << ",\"missProbeAvg\":" << missProbeAvg
+                << ",\"rehashCount\":" << rehashCount << ",\"rehashSeconds\":" << rehashSeconds;
+        }
+        out << "}";
+        return out.str();
+    }
+};
+
+/**
+ * The on-disk image of a hashtable, written by HashTable::save
+ * Layout (native byte order):
+ * - the header
+ * - bucketSize + 1 offsets (uint64_t), bucket b holds entries [offsets[b], offsets[b + 1])
+ * - tableSize entries {Key, Value}, bucket by bucket in chain order, aligned to the entry
+ */
+struct HashTableSnapshotHeader {
+    static constexpr char MAGIC[8] = { 'H', 'T', 'S', 'N', 'A', 'P', '0', '1' };
+
+    char magic[8];
+    uint32_t keySize; // sizeof(Key), to reject images of another key type
+    uint32_t valueSize; // sizeof(Value), to reject images of another value type
+    uint64_t tableSize;
+    uint64_t bucketSize;
+    uint64_t entryOffset; // byte offset of the first entry
+    double maxLoadFactor;
+
+    /**
+     * Validate the header and the offsets table, so that the image can be read without checks
+     * Time Complexity: O(number of buckets)
+     * @throw std::runtime_error if the image is not a snapshot of the expected types,
+     *        or if it is truncated or corrupt
+     * @param file
+     * @param keySize
+     * @param valueSize
+     * @param entrySize sizeof(MappedHashTable::Entry), the size of a stored {Key, Value} entry
+     * @param entryAlign alignof(MappedHashTable::Entry), the entries are read in place
+     * @return the validated header at the beginning of file
+     */
+    static const HashTableSnapshotHeader& check(
+        const MappedFile& file, size_t keySize, size_t valueSize, size_t entrySize,
+        size_t entryAlign
+    ) {
+        if (file.size() < sizeof(HashTableSnapshotHeader)) {
+            throw std::runtime_error("truncated hashtable snapshot");
+        }
+        auto& header = *reinterpret_cast<const HashTableSnapshotHeader*>(file.data());
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.keySize != keySize
+            || header.valueSize != valueSize)
+        {
+            throw std::runtime_error("not a hashtable snapshot of this type");
+        }
+        // compare counts rather than byte sizes, so that corrupt counts can not overflow
+        size_t offsetCapacity = (file.size() - sizeof(header)) / sizeof(uint64_t);
+        if (header.bucketSize == 0 || header.bucketSize >= offsetCapacity
+            || header.entryOffset < sizeof(header) + (header.bucketSize + 1) * sizeof(uint64_t)
+            || header.entryOffset > file.size() || header.entryOffset % entryAlign != 0
+            || header.tableSize > (file.size() - header.entryOffset) / entrySize)
+        {
+            throw std::runtime_error("truncated hashtable snapshot");
+        }
+        auto offsets = reinterpret_cast<const uint64_t*>(file.data() + sizeof(header));
+        if (offsets[0] != 0 || offsets[header.bucketSize] != header.tableSize) {
+            throw std::runtime_error("corrupt hashtable snapshot");
+        }
+        for (uint64_t i = 0; i < header.bucketSize; i++) {
+            if (offsets[i] > offsets[i + 1]) {
+                throw std::runtime_error("corrupt hashtable snapshot");
+            }
+        }
+        return header;
+    }
+};
+
+template<typename Key, typename Value, typename Hash, typename KeyEqual>
+class MappedHashTable;
+
 /**
  * The Hashtable class
  * The time complexity of functions are based on n and k
@@ -17,12 +149,14 @@
  * @tparam Value        data type
  * @tparam Hash         function object, return the hash value of a key
  * @tparam KeyEqual     function object, return whether two keys are the same
+ * @tparam CollectStats whether to count probes and rehashes for stats(), free if false
  */
 template<
     typename Key,
     typename Value,
     typename Hash = std::hash<Key>,
-    typename KeyEqual = std::equal_to<Key>>
+    typename KeyEqual = std::equal_to<Key>,
+    bool CollectStats = false>
 class HashTable {
 public:
     typedef std::pair<const Key, Value> HashNode;
@@ -147,6 +281,21 @@ protected: // DO NOT USE private HERE!
     Hash hash; // hash function instance
     KeyEqual keyEqual; // key equal function instance
 
+    struct Counters {
+        size_t hitCount = 0;
+        size_t missCount = 0;
+        size_t hitProbes = 0;
+        size_t missProbes = 0;
+        size_t hitProbeMax = 0;
+        size_t missProbeMax = 0;
+        size_t rehashCount = 0;
+        double rehashSeconds = 0;
+    };
+    struct NoCounters {};
+
+    // probe and rehash counters, an empty struct if CollectStats is false
+    typename std::conditional<CollectStats, Counters, NoCounters>::type counters;
+
     /**
      * Time Complexity: O(k)
      * @param key
@@ -186,6 +335,44 @@ protected: // DO NOT USE private HERE!
         throw std::range_error("no such bucket size can be found!");
     }
 
+    /**
+     * Record a lookup for stats(), do nothing if CollectStats is false
+     * Time Complexity: O(1)
+     * @param hit whether the key was found
+     * @param probes number of key comparisons of the lookup
+     */
+    inline void recordProbe(bool hit, size_t probes) {
+        if constexpr (CollectStats) {
+            if (hit) {
+                ++counters.hitCount;
+                counters.hitProbes += probes;
+                counters.hitProbeMax = std::max(counters.hitProbeMax, probes);
+            } else {
+                ++counters.missCount;
+                counters.missProbes += probes;
+                counters.missProbeMax = std::max(counters.missProbeMax, probes);
+            }
+        }
+    }
+
+    /**
+     * Run task(0), ..., task(tasks - 1), each on its own thread
+     * The calling thread runs task(0)
+     * @param tasks
+     * @param task
+     */
+    template<typename Task>
+    static void parallelRun(size_t tasks, const Task& task) {
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < tasks; t++) {
+            workers.emplace_back(task, t);
+        }
+        task(0);
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
     // define your helper functions here if necessary
 
 public:
@@ -213,6 +400,7 @@ public:
         this->maxLoadFactor = that.maxLoadFactor;
         this->hash = that.hash;
         this->keyEqual = that.keyEqual;
+        this->counters = that.counters;
         this->buckets = that.buckets;
         this->firstBucketIt = this->buckets.begin() + (that.firstBucketIt - that.buckets.begin());
     }
@@ -225,6 +413,7 @@ public:
         this->maxLoadFactor = that.maxLoadFactor;
         this->hash = that.hash;
         this->keyEqual = that.keyEqual;
+        this->counters = that.counters;
         this->buckets = that.buckets;
         this->firstBucketIt = this->buckets.begin() + (that.firstBucketIt - that.buckets.begin());
         return *this;
@@ -268,15 +457,20 @@ public:
         if (it.bucketIt->empty()) {
             // std::cout << "key: " << key << " empty" << std::endl;
             it.endFlag = true;
+            recordProbe(false, 0);
             return it;
         }
+        size_t probes = 0;
         while (buckets.begin() + hashKey(key) == it.bucketIt) {
+            ++probes;
             if (keyEqual(it->first, key)) {
                 // std::cout << "key: " << key << " found" << std::endl;
+                recordProbe(true, probes);
                 return it;
             }
             it++;
         }
+        recordProbe(false, probes);
         it.bucketIt = buckets.begin() + hashKey(key);
         it.listItBefore = it.bucketIt->before_begin();
         it.endFlag = true;
@@ -403,6 +597,10 @@ public:
         if (bucketSize == buckets.size()) {
             return;
         }
+        std::chrono::steady_clock::time_point start;
+        if constexpr (CollectStats) {
+            start = std::chrono::steady_clock::now();
+        }
         HashTableData newBuckets(bucketSize);
         for (auto& bucket: buckets) {
             for (auto& node: bucket) {
@@ -418,6 +616,109 @@ public:
                 break;
             }
         }
+        if constexpr (CollectStats) {
+            ++counters.rehashCount;
+            counters.rehashSeconds +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    /**
+     * Rehash so that n elements in total can be held without another rehash
+     * Never shrinks the number of buckets
+     * Time Complexity: O(nk) if a rehash takes place, otherwise O(1)
+     * @throw std::range_error if no such bucket size can be found
+     * @param n number of elements
+     */
+    void reserve(size_t n) {
+        auto bucketSize = static_cast<size_t>(static_cast<double>(n) / maxLoadFactor) + 1;
+        rehash(std::max(bucketSize, buckets.size()));
+    }
+
+    /**
+     * Insert all pairs in [first, last) into the hashtable
+     * If a key already exists or appears several times, the last value in the range wins
+     * The buckets are sized once, then keys are hashed in parallel, partitioned by bucket
+     * range, and each partition is linked by its own thread without any locking
+     * Hash and KeyEqual must be safe to call concurrently
+     * Time Complexity: O(nk / threads) expected, plus at most one rehash
+     * @tparam ForwardIt iterator of std::pair<Key, Value> (or std::pair<const Key, Value>)
+     * @param first
+     * @param last
+     * @param threads number of threads, 0 for std::thread::hardware_concurrency()
+     */
+    template<typename ForwardIt>
+    void build(ForwardIt first, ForwardIt last, size_t threads = 0) {
+        constexpr size_t GRAIN = 1 << 14; // minimum number of pairs per thread
+        std::vector<ForwardIt> pairs;
+        for (auto it = first; it != last; ++it) {
+            pairs.push_back(it);
+        }
+        if (pairs.empty()) {
+            return;
+        }
+        reserve(tableSize + pairs.size());
+        if (threads == 0) {
+            threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        threads = std::max<size_t>(std::min(threads, pairs.size() / GRAIN), 1);
+
+        // chunk t of the input is [t * n / threads, (t + 1) * n / threads)
+        // partition p owns the buckets [p * m / threads, (p + 1) * m / threads)
+        size_t n = pairs.size(), m = buckets.size();
+        std::vector<size_t> bucketIndex(n);
+        std::vector<size_t> counts(threads * threads); // [chunk * threads + partition]
+        parallelRun(threads, [&](size_t chunk) {
+            for (size_t i = chunk * n / threads; i < (chunk + 1) * n / threads; i++) {
+                bucketIndex[i] = hashKey(pairs[i]->first);
+                ++counts[chunk * threads + bucketIndex[i] * threads / m];
+            }
+        });
+        // exclusive prefix sum in partition-major order keeps the input order in each partition
+        std::vector<size_t> partitionBegin(threads + 1);
+        size_t position = 0;
+        for (size_t partition = 0; partition < threads; partition++) {
+            partitionBegin[partition] = position;
+            for (size_t chunk = 0; chunk < threads; chunk++) {
+                size_t count = counts[chunk * threads + partition];
+                counts[chunk * threads + partition] = position;
+                position += count;
+            }
+        }
+        partitionBegin[threads] = position;
+        std::vector<size_t> order(n);
+        parallelRun(threads, [&](size_t chunk) {
+            for (size_t i = chunk * n / threads; i < (chunk + 1) * n / threads; i++) {
+                order[counts[chunk * threads + bucketIndex[i] * threads / m]++] = i;
+            }
+        });
+        std::vector<size_t> inserted(threads);
+        parallelRun(threads, [&](size_t partition) {
+            for (size_t j = partitionBegin[partition]; j < partitionBegin[partition + 1]; j++) {
+                auto& pair = *pairs[order[j]];
+                auto& bucket = buckets[bucketIndex[order[j]]];
+                auto it = bucket.begin();
+                while (it != bucket.end() && !keyEqual(it->first, pair.first)) {
+                    ++it;
+                }
+                if (it != bucket.end()) {
+                    it->second = pair.second;
+                } else {
+                    bucket.emplace_front(pair.first, pair.second);
+                    ++inserted[partition];
+                }
+            }
+        });
+        for (size_t count: inserted) {
+            tableSize += count;
+        }
+        firstBucketIt = buckets.end();
+        for (auto it = buckets.begin(); it != buckets.end(); ++it) {
+            if (!it->empty()) {
+                firstBucketIt = it;
+                break;
+            }
+        }
     }
 
     /**
@@ -460,4 +761,220 @@ public:
         maxLoadFactor = loadFactor;
         rehash(buckets.size());
     }
+
+    /**
+     * Write the hashtable to a snapshot file, which can be loaded by load or MappedHashTable
+     * The image is only valid for the same Key, Value and Hash on the same architecture,
+     * so Hash must not depend on per-process state (e.g. a random seed)
+     * Time Complexity: O(n + number of buckets)
+     * @throw std::runtime_error if the file can not be written
+     * @param path
+     */
+    void save(const std::string& path) const {
+        static_assert(
+            std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+            "only trivially copyable keys and values can be saved"
+        );
+        typedef typename MappedHashTable<Key, Value, Hash, KeyEqual>::Entry Entry;
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("can not open " + path);
+        }
+        HashTableSnapshotHeader header {};
+        std::memcpy(header.magic, HashTableSnapshotHeader::MAGIC, sizeof(header.magic));
+        header.keySize = sizeof(Key);
+        header.valueSize = sizeof(Value);
+        header.tableSize = tableSize;
+        header.bucketSize = buckets.size();
+        size_t offsetsEnd = sizeof(header) + (buckets.size() + 1) * sizeof(uint64_t);
+        header.entryOffset = (offsetsEnd + alignof(Entry) - 1) / alignof(Entry) * alignof(Entry);
+        header.maxLoadFactor = maxLoadFactor;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t offset = 0;
+        for (auto& bucket: buckets) {
+            out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+            offset += static_cast<uint64_t>(std::distance(bucket.begin(), bucket.end()));
+        }
+        out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        const char padding[alignof(Entry)] = {};
+        out.write(padding, static_cast<std::streamsize>(header.entryOffset - offsetsEnd));
+        for (auto& bucket: buckets) {
+            for (auto& node: bucket) {
+                Entry entry;
+                std::memset(&entry, 0, sizeof(entry));
+                std::memcpy(&entry.key, &node.first, sizeof(Key));
+                std::memcpy(&entry.value, &node.second, sizeof(Value));
+                out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("can not write " + path);
+        }
+    }
+
+    /**
+     * Replace the content of the hashtable by a snapshot written by save
+     * The bucket layout is restored in a single sequential pass, without hashing or rehash
+     * Time Complexity: O(n + number of buckets)
+     * @throw std::runtime_error if the file is not a snapshot of this type
+     * @param path
+     */
+    void load(const std::string& path) {
+        typedef typename MappedHashTable<Key, Value, Hash, KeyEqual>::Entry Entry;
+        MappedFile file(path);
+        file.adviseSequential();
+        auto& header = HashTableSnapshotHeader::check(
+            file, sizeof(Key), sizeof(Value), sizeof(Entry), alignof(Entry)
+        );
+        auto offsets = reinterpret_cast<const uint64_t*>(file.data() + sizeof(header));
+        auto entries = reinterpret_cast<const Entry*>(file.data() + header.entryOffset);
+        HashTableData newBuckets(header.bucketSize);
+        for (size_t i = 0; i < newBuckets.size(); i++) {
+            auto tail = newBuckets[i].before_begin();
+            for (uint64_t j = offsets[i]; j < offsets[i + 1]; j++) {
+                tail = newBuckets[i].emplace_after(tail, entries[j].key, entries[j].value);
+            }
+        }
+        buckets.swap(newBuckets);
+        tableSize = header.tableSize;
+        maxLoadFactor = header.maxLoadFactor;
+        firstBucketIt = buckets.end();
+        for (auto it = buckets.begin(); it != buckets.end(); ++it) {
+            if (!it->empty()) {
+                firstBucketIt = it;
+                break;
+            }
+        }
+    }
+
+    /**
+     * Collect the statistics of the hashtable
+     * The probe and rehash counters are only filled if CollectStats is true
+     * Time Complexity: O(n + number of buckets)
+     * @return the statistics
+     */
+    HashTableStats stats() const {
+        HashTableStats result;
+        result.size = tableSize;
+        result.bucketSize = buckets.size();
+        result.loadFactor = loadFactor();
+        result.maxLoadFactor = maxLoadFactor;
+        double squares = 0;
+        size_t empty = 0;
+        for (auto& bucket: buckets) {
+            size_t length = static_cast<size_t>(std::distance(bucket.begin(), bucket.end()));
+            if (length >= result.chainLengthHistogram.size()) {
+                result.chainLengthHistogram.resize(length + 1);
+            }
+            ++result.chainLengthHistogram[length];
+            result.maxChainLength = std::max(result.maxChainLength, length);
+            squares += static_cast<double>(length) * static_cast<double>(length);
+            if (length == 0) {
+                ++empty;
+            }
+        }
+        result.emptyBucketRatio = static_cast<double>(empty) / static_cast<double>(buckets.size());
+        if (tableSize > 0) {
+            // E[sum of squared chain lengths] = n + n(n-1)/m for a uniform hash
+            double n = static_cast<double>(tableSize);
+            result.collisionScore = squares / (n + n * (n - 1) / static_cast<double>(buckets.size()));
+        }
+        if constexpr (CollectStats) {
+            result.collected = true;
+            result.hitCount = counters.hitCount;
+            result.missCount = counters.missCount;
+            result.hitProbeMax = counters.hitProbeMax;
+            result.missProbeMax = counters.missProbeMax;
+            if (counters.hitCount) {
+                result.hitProbeAvg = static_cast<double>(counters.hitProbes) / static_cast<double>(counters.hitCount);
+            }
+            if (counters.missCount) {
+                result.missProbeAvg = static_cast<double>(counters.missProbes) / static_cast<double>(counters.missCount);
+            }
+            result.rehashCount = counters.rehashCount;
+            result.rehashSeconds = counters.rehashSeconds;
+        }
+        return result;
+    }
+
+    /**
+     * Reset the probe and rehash counters, do nothing if CollectStats is false
+     */
+    void resetStats() {
+        counters = decltype(counters)();
+    }
+};
+
+/**
+ * A read-only hashtable served directly from a snapshot file written by HashTable::save
+ * Nothing is copied at construction, only the offsets table is read once to validate it
+ * Entry pages are loaded lazily on first access
+ * Time complexity of find is the same as HashTable, plus page faults on cold pages
+ * @tparam Key          key type, trivially copyable
+ * @tparam Value        data type, trivially copyable
+ * @tparam Hash         function object, must be the one used by the saved HashTable
+ * @tparam KeyEqual     function object, return whether two keys are the same
+ */
+template<
+    typename Key,
+    typename Value,
+    typename Hash = std::hash<Key>,
+    typename KeyEqual = std::equal_to<Key>>
+class MappedHashTable {
+public:
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+private:
+    MappedFile file;
+    const uint64_t* offsets;
+    const Entry* entries;
+    size_t tableSize;
+    size_t bucketCount;
+    Hash hash;
+    KeyEqual keyEqual;
+
+public:
+    /**
+     * @throw std::runtime_error if the file is not a snapshot of this type
+     * @param path
+     */
+    explicit MappedHashTable(const std::string& path): file(path), hash(Hash()), keyEqual(KeyEqual()) {
+        auto& header = HashTableSnapshotHeader::check(
+            file, sizeof(Key), sizeof(Value), sizeof(Entry), alignof(Entry)
+        );
+        offsets = reinterpret_cast<const uint64_t*>(file.data() + sizeof(header));
+        entries = reinterpret_cast<const Entry*>(file.data() + header.entryOffset);
+        tableSize = header.tableSize;
+        bucketCount = header.bucketSize;
+    }
+
+    /**
+     * Time Complexity: Amortized O(k)
+     * @param key
+     * @return pointer to the value in the mapping, or nullptr if the key doesn't exist
+     */
+    const Value* find(const Key& key) const {
+        size_t bucket = hash(key) % bucketCount;
+        for (uint64_t i = offsets[bucket]; i < offsets[bucket + 1]; i++) {
+            if (keyEqual(entries[i].key, key)) {
+                return &entries[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    bool contains(const Key& key) const {
+        return find(key) != nullptr;
+    }
+
+    size_t size() const {
+        return tableSize;
+    }
+
+    size_t bucketSize() const {
+        return bucketCount;
+    }
 };
@@ -0,0 +1,269 @@
+// Behaviour tests of HashTable, exits with a non-zero status if any check fails
+// build: g++ -std=c++17 -O2 -pthread -o hashtable_test hashtable_test.cpp
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hashers.hpp"
+#include "hashtable.hpp"
+
+static size_t g_failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition     \
+                      << std::endl;                                                       \
+            ++g_failures;                                                                 \
+        }                                                                                 \
+    } while (false)
+
+/**
+ * @return whether open throws std::runtime_error
+ */
+template<typename Open>
+bool rejects(Open open) {
+    try {
+        open();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+void testStats() {
+    // every key in one chain, so that the probe counts are known
+    struct OneChain {
+        size_t operator()(int) const {
+            return 0;
+        }
+    };
+    HashTable<int, int, OneChain, std::equal_to<int>, true> table;
+    for (int key = 0; key < 10; key++) {
+        table.insert(key, key);
+    }
+    table.resetStats();
+    CHECK(table.stats().hitCount == 0 && table.stats().rehashCount == 0);
+    for (int key = 0; key < 10; key++) {
+        CHECK(table.contains(key));
+    }
+    CHECK(!table.contains(10));
+    HashTableStats stats = table.stats();
+    CHECK(stats.collected);
+    CHECK(stats.hitCount == 10 && stats.missCount == 1);
+    CHECK(stats.hitProbeAvg == 5.5 && stats.hitProbeMax == 10);
+    CHECK(stats.missProbeMax == 10);
+    CHECK(stats.maxChainLength == 10);
+    CHECK(stats.toJson().find("\"hitCount\":10") != std::string::npos);
+
+    HashTable<int, int, std::hash<int>, std::equal_to<int>, true> growing;
+    for (int key = 0; key < 1000; key++) {
+        growing.insert(key, key);
+    }
+    stats = growing.stats();
+    CHECK(stats.rehashCount > 0 && stats.rehashSeconds >= 0);
+    size_t buckets = 0, elements = 0;
+    for (size_t length = 0; length < stats.chainLengthHistogram.size(); length++) {
+        buckets += stats.chainLengthHistogram[length];
+        elements += length * stats.chainLengthHistogram[length];
+    }
+    CHECK(buckets == growing.bucketSize() && elements == 1000);
+
+    // without CollectStats only the structural fields are filled
+    HashTable<int, int> plain;
+    plain.insert(1, 1);
+    plain.contains(1);
+    stats = plain.stats();
+    CHECK(!stats.collected && stats.hitCount == 0 && stats.size == 1);
+    CHECK(stats.toJson().find("hitCount") == std::string::npos);
+}
+
+void testSnapshot() {
+    typedef HashTable<uint64_t, int> Table;
+    typedef MappedHashTable<uint64_t, int> Mapped;
+    std::string path = (std::filesystem::temp_directory_path() / "hashtable_test.snap").string();
+    Table table;
+    for (uint64_t key = 0; key < 1000; key++) {
+        table.insert(key * 7919, static_cast<int>(key));
+    }
+    table.erase(7919);
+    table.save(path);
+
+    Table loaded;
+    loaded.insert(1, 1);
+    loaded.load(path);
+    CHECK(loaded.size() == table.size());
+    CHECK(loaded.bucketSize() == table.bucketSize());
+    CHECK(!loaded.contains(1));
+    CHECK(!loaded.contains(7919));
+    for (auto& [key, value]: table) {
+        auto it = loaded.find(key);
+        CHECK(it != loaded.end() && it->second == value);
+    }
+    // the chain order is restored, so both tables iterate the same sequence
+    auto it = loaded.begin();
+    for (auto& node: table) {
+        CHECK(it != loaded.end() && it->first == node.first);
+        ++it;
+    }
+
+    Mapped mapped(path);
+    CHECK(mapped.size() == table.size());
+    CHECK(mapped.bucketSize() == table.bucketSize());
+    for (uint64_t key = 0; key < 1000; key++) {
+        const int* value = mapped.find(key * 7919);
+        CHECK(key == 1 ? value == nullptr : value != nullptr && *value == static_cast<int>(key));
+    }
+    CHECK(!mapped.contains(3));
+
+    // a snapshot of another type, a truncated one and corrupt offsets are all rejected
+    CHECK(rejects([&]() { MappedHashTable<uint32_t, int> other(path); }));
+    std::string bytes = readFile(path);
+    std::string corruptPath = path + ".corrupt";
+    auto rejectsBytes = [&](const std::string& corrupt) {
+        writeFile(corruptPath, corrupt);
+        return rejects([&]() { Mapped m(corruptPath); })
+            && rejects([&]() { Table().load(corruptPath); });
+    };
+    CHECK(rejectsBytes(bytes.substr(0, sizeof(HashTableSnapshotHeader) - 1)));
+    CHECK(rejectsBytes(bytes.substr(0, bytes.size() - 1)));
+    CHECK(rejectsBytes(bytes.substr(0, sizeof(HashTableSnapshotHeader) + 16)));
+    size_t offsets = sizeof(HashTableSnapshotHeader);
+    auto withOffset = [&](size_t index, uint64_t offset) {
+        std::string corrupt = bytes;
+        std::memcpy(&corrupt[offsets + index * sizeof(uint64_t)], &offset, sizeof(offset));
+        return corrupt;
+    };
+    size_t buckets = table.bucketSize();
+    CHECK(rejectsBytes(withOffset(buckets, table.size() + 1)));
+    CHECK(rejectsBytes(withOffset(buckets / 2, ~uint64_t(0))));
+    CHECK(rejectsBytes(withOffset(0, 1)));
+    std::string hugeBuckets = bytes;
+    uint64_t bucketSize = ~uint64_t(0) / 2;
+    std::memcpy(
+        &hugeBuckets[offsetof(HashTableSnapshotHeader, bucketSize)], &bucketSize, sizeof(bucketSize)
+    );
+    CHECK(rejectsBytes(hugeBuckets));
+    // an entry offset off the entry alignment, with room left for every entry
+    std::string misaligned = bytes + std::string(16, '\0');
+    uint64_t entryOffset;
+    std::memcpy(
+        &entryOffset, &bytes[offsetof(HashTableSnapshotHeader, entryOffset)], sizeof(entryOffset)
+    );
+    entryOffset += 4;
+    std::memcpy(
+        &misaligned[offsetof(HashTableSnapshotHeader, entryOffset)], &entryOffset,
+        sizeof(entryOffset)
+    );
+    CHECK(rejectsBytes(misaligned));
+    std::filesystem::remove(path);
+    std::filesystem::remove(corruptPath);
+}
+
+void testBuild() {
+    std::mt19937_64 random(2810);
+    for (size_t threads: { 1, 2, 4, 8 }) {
+        // enough pairs for every thread to get a chunk, with duplicate keys across chunks
+        std::vector<std::pair<uint64_t, uint64_t>> pairs(200000);
+        for (size_t i = 0; i < pairs.size(); i++) {
+            pairs[i] = { random() % 150000, i };
+        }
+        HashTable<uint64_t, uint64_t> table;
+        std::unordered_map<uint64_t, uint64_t> model;
+        for (uint64_t key = 140000; key < 160000; key++) {
+            table.insert(key, 0);
+            model[key] = 0;
+        }
+        table.build(pairs.begin(), pairs.end(), threads);
+        for (auto& [key, value]: pairs) {
+            model[key] = value;
+        }
+        CHECK(table.size() == model.size());
+        CHECK(table.loadFactor() <= table.getMaxLoadFactor());
+        size_t iterated = 0;
+        for (auto& [key, value]: table) {
+            auto it = model.find(key);
+            CHECK(it != model.end() && it->second == value);
+            ++iterated;
+        }
+        CHECK(iterated == model.size());
+    }
+    HashTable<int, int> empty;
+    std::vector<std::pair<int, int>> none;
+    empty.build(none.begin(), none.end());
+    CHECK(empty.size() == 0 && empty.begin() == empty.end());
+}
+
+void testHashers() {
+    std::mt19937_64 random(2810);
+    std::vector<unsigned char> bytes(1024 + 8);
+    for (auto& byte: bytes) {
+        byte = static_cast<unsigned char>(random());
+    }
+    uint64_t key[8];
+    for (auto& k: key) {
+        k = random();
+    }
+    // the AVX2 and the portable accumulation agree, and the hash does not depend on where
+    // the key starts, across the short and the long path
+    for (size_t len = 0; len <= 1024; len++) {
+        uint64_t h = HashFunction::hashBytes(bytes.data(), len, 7);
+        for (size_t start = 1; start < 8; start++) {
+            std::vector<unsigned char> copy(bytes.begin(), bytes.begin() + len);
+            copy.insert(copy.begin(), start, 0);
+            CHECK(HashFunction::hashBytes(copy.data() + start, len, 7) == h);
+#ifdef HASH_FUNCTION_X86
+            if (HashFunction::hasAvx2()) {
+                uint64_t scalar[8], avx2[8];
+                for (size_t lane = 0; lane < 8; lane++) {
+                    scalar[lane] = avx2[lane] = key[lane] ^ lane;
+                }
+                size_t stripes = len / HashFunction::STRIPE;
+                HashFunction::accumulateScalar(scalar, bytes.data() + start, stripes, key);
+                HashFunction::accumulateAvx2(avx2, bytes.data() + start, stripes, key);
+                CHECK(std::equal(scalar, scalar + 8, avx2));
+            }
+#endif
+        }
+    }
+
+    // the default seed gives the same hashes in every instance, a random seed does not
+    std::string text(300, 'x');
+    CHECK(HashFunction::Fast<std::string>()(text) == HashFunction::Fast<std::string>()(text));
+    CHECK(HashFunction::Fast<uint64_t>()(42) == HashFunction::Fast<uint64_t>()(42));
+    HashFunction::Randomized<std::string> first, second;
+    CHECK(first.seed != second.seed && first(text) != second(text));
+    CHECK(HashFunction::Randomized<int>().seed != HashFunction::Randomized<int>().seed);
+}
+
+int main() {
+    testStats();
+    testSnapshot();
+    testBuild();
+    testHashers();
+    if (g_failures) {
+        std::cerr << g_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
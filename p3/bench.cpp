@@ -0,0 +1,345 @@
+// KDTree benchmark: build, insert, find, findMin / findMax, k nearest neighbors, erase and
+// iteration throughput, and the speed / recall trade-off of KDForest
+// usage: ./bench [--n=N] [--dims=2,3,4,8] [--dist=uniform,clustered,sorted] [--balance=ALPHA]
+//                [--seed=N]
+// "sorted" inserts points along the diagonal in increasing order, the worst case of insert
+// --balance enables scapegoat rebalancing of the incrementally built tree (e.g. --balance=0.7)
+// Build with -DKDTREE_INSTRUMENTATION to also report the nodes visited per operation
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "implicit_kdtree.hpp"
+#include "kdtree.hpp"
+
+struct Options {
+    size_t n = 1000000;
+    std::vector<size_t> dims = { 2, 3, 4, 8 };
+    std::vector<std::string> dists = { "uniform", "clustered", "sorted" };
+    double balance = 0;
+    uint64_t seed = 2810;
+};
+
+// results of the timed loops are stored here, so that the loops are not optimized out
+static volatile double g_sink = 0;
+
+template<size_t K, typename... Ts>
+struct PointOf {
+    typedef typename PointOf<K - 1, double, Ts...>::type type;
+};
+
+template<typename... Ts>
+struct PointOf<0, Ts...> {
+    typedef std::tuple<Ts...> type;
+};
+
+template<typename Key, size_t... DIMS>
+Key makeKey(const double* coords, std::index_sequence<DIMS...>) {
+    return Key(coords[DIMS]...);
+}
+
+/**
+ * Generate n distinct points of the distribution, in insertion order
+ */
+template<size_t K>
+std::vector<typename PointOf<K>::type> generate(const std::string& dist, size_t n, std::mt19937_64& random) {
+    typedef typename PointOf<K>::type Key;
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> normal(0, 0.01);
+    constexpr size_t CLUSTERS = 16;
+    double centers[CLUSTERS][K];
+    for (auto& center: centers) {
+        for (double& x: center) {
+            x = uniform(random);
+        }
+    }
+    std::vector<Key> keys(n);
+    double coords[K];
+    for (size_t i = 0; i < n; i++) {
+        for (size_t d = 0; d < K; d++) {
+            if (dist == "clustered") {
+                coords[d] = centers[i % CLUSTERS][d] + normal(random);
+            } else if (dist == "sorted") {
+                coords[d] = static_cast<double>(i) / static_cast<double>(n);
+            } else {
+                coords[d] = uniform(random);
+            }
+        }
+        keys[i] = makeKey<Key>(coords, std::make_index_sequence<K>());
+    }
+    return keys;
+}
+
+/**
+ * Time ops calls of f and print throughput (and visits per call if instrumented)
+ * @return the elapsed seconds
+ */
+template<typename F>
+double measure(size_t dims, const std::string& dist, const std::string& op, size_t ops, F f) {
+    typedef std::chrono::steady_clock Clock;
+    size_t visits = KDTreeInstrumentation::visits();
+    auto start = Clock::now();
+    f();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    visits = KDTreeInstrumentation::visits() - visits;
+    std::cout << std::setw(5) << dims << "  " << std::left << std::setw(11) << dist << std::setw(10) << op
+              << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+              << static_cast<double>(ops) / seconds / 1e6 << std::setw(12);
+#ifdef KDTREE_INSTRUMENTATION
+    std::cout << std::setprecision(1) << static_cast<double>(visits) / static_cast<double>(ops);
+#else
+    std::cout << "-";
+#endif
+    std::cout << std::endl;
+    return seconds;
+}
+
+void printShape(const std::string& name, const KDTreeShape& shape) {
+    std::cout << "    " << std::left << std::setw(12) << name << std::right << "max depth " << shape.maxDepth
+              << ", average depth " << std::setprecision(1) << shape.averageDepth << ", balance";
+    for (size_t count: shape.balanceHistogram) {
+        std::cout << " " << count;
+    }
+    std::cout << std::endl;
+}
+
+template<size_t K>
+void run(const Options& options, const std::string& dist) {
+    typedef typename PointOf<K>::type Key;
+    typedef KDTree<Key, size_t> Tree;
+    std::mt19937_64 random(options.seed);
+    auto keys = generate<K>(dist, options.n, random);
+    std::vector<std::pair<Key, size_t>> entries(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        entries[i] = { keys[i], i };
+    }
+    std::vector<Key> shuffled = keys;
+    std::shuffle(shuffled.begin(), shuffled.end(), random);
+
+    Tree* built = nullptr;
+    measure(K, dist, "build", keys.size(), [&]() {
+        built = new Tree(entries);
+    });
+
+    // without rebalancing, sorted insertion builds a path, whose recursion depth is the size
+    constexpr size_t PATH_LIMIT = 1 << 14;
+    size_t insertCount = keys.size();
+    if (dist == "sorted" && options.balance <= 0 && insertCount > PATH_LIMIT) {
+        insertCount = PATH_LIMIT;
+        std::cout << "    (insert limited to " << PATH_LIMIT << " points, use --balance)" << std::endl;
+    }
+    Tree inserted;
+    if (options.balance > 0) {
+        inserted.setBalanceFactor(options.balance);
+    }
+    measure(K, dist, "insert", insertCount, [&]() {
+        for (size_t i = 0; i < insertCount; i++) {
+            inserted.insert(keys[i], i);
+        }
+    });
+
+    size_t found = 0;
+    measure(K, dist, "find", shuffled.size(), [&]() {
+        for (auto& key: shuffled) {
+            found += built->find(key) != built->end();
+        }
+    });
+    if (found != built->size()) {
+        std::cerr << "find mismatch" << std::endl;
+        std::exit(1);
+    }
+
+    constexpr size_t ROUNDS = 1000;
+    measure(K, dist, "min/max", 2 * K * ROUNDS, [&]() {
+        for (size_t round = 0; round < ROUNDS; round++) {
+            for (size_t dim = 0; dim < K; dim++) {
+                g_sink = g_sink + std::get<0>(built->findMin(dim)->first) + std::get<0>(built->findMax(dim)->first);
+            }
+        }
+    });
+
+    // 10 nearest neighbors of fresh points: exact, then randomized forests with a leaf budget
+    constexpr size_t QUERIES = 1000, NEIGHBORS = 10;
+    auto queries = generate<K>(dist, QUERIES, random);
+    std::vector<std::vector<typename Tree::Iterator>> exact(QUERIES);
+    double seconds = measure(K, dist, "knn", QUERIES, [&]() {
+        for (size_t i = 0; i < QUERIES; i++) {
+            exact[i] = built->nearest(queries[i], NEIGHBORS);
+        }
+    });
+    std::cout << "    exact, " << std::setprecision(1) << seconds / QUERIES * 1e6 << " us/query"
+              << std::endl;
+    for (size_t trees: { 1, 4 }) {
+        KDForest<Key, size_t> forest(entries, trees, options.seed);
+        for (size_t leaves: { 1, 4, 16 }) {
+            std::vector<std::vector<typename KDForest<Key, size_t>::Neighbor>> approx(QUERIES);
+            std::ostringstream op;
+            op << "forest" << trees << "/" << leaves;
+            seconds = measure(K, dist, op.str(), QUERIES, [&]() {
+                for (size_t i = 0; i < QUERIES; i++) {
+                    approx[i] = forest.nearest(queries[i], NEIGHBORS, 0, leaves);
+                }
+            });
+            size_t found = 0;
+            for (size_t i = 0; i < QUERIES; i++) {
+                for (auto& it: exact[i]) {
+                    for (auto& neighbor: approx[i]) {
+                        found += neighbor.key == it->first;
+                    }
+                }
+            }
+            std::cout << "    recall " << std::setprecision(3)
+                      << static_cast<double>(found) / static_cast<double>(QUERIES * NEIGHBORS) << ", "
+                      << std::setprecision(1) << seconds / QUERIES * 1e6 << " us/query" << std::endl;
+        }
+    }
+
+    measure(K, dist, "iterate", built->size(), [&]() {
+        size_t sum = 0;
+        for (auto& data: *built) {
+            sum += data.second;
+        }
+        g_sink = static_cast<double>(sum);
+    });
+
+    measure(K, dist, "erase", shuffled.size() / 2, [&]() {
+        for (size_t i = 0; i < shuffled.size() / 2; i++) {
+            built->erase(shuffled[i]);
+        }
+    });
+
+    printShape("built", Tree(entries).shapeStats());
+    printShape("inserted", inserted.shapeStats());
+    printShape("erased", built->shapeStats());
+    delete built;
+}
+
+template<size_t K>
+void runDims(const Options& options) {
+    for (auto& dist: options.dists) {
+        run<K>(options, dist);
+    }
+}
+
+/**
+ * Parse the whole of value into result
+ * @return false if value is not a number of type T, signs are rejected for unsigned types
+ */
+template<typename T>
+bool parse(const std::string& value, T& result) {
+    if (std::is_unsigned<T>::value && value.find('-') != std::string::npos) {
+        return false;
+    }
+    std::istringstream in(value);
+    return in >> result && (in >> std::ws).eof();
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        std::istringstream in(value);
+        bool valid = true;
+        if (name == "--n") {
+            valid = parse(value, options.n);
+        } else if (name == "--dims") {
+            options.dims.clear();
+            for (std::string dims; valid && std::getline(in, dims, ',');) {
+                options.dims.push_back(0);
+                valid = parse(dims, options.dims.back());
+            }
+        } else if (name == "--dist") {
+            options.dists.clear();
+            for (std::string dist; std::getline(in, dist, ',');) {
+                options.dists.push_back(dist);
+            }
+        } else if (name == "--balance") {
+            valid = parse(value, options.balance);
+        } else if (name == "--seed") {
+            valid = parse(value, options.seed);
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+        if (!valid) {
+            std::cerr << "invalid value in " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (options.n == 0) {
+        std::cerr << "--n must be positive" << std::endl;
+        return 1;
+    }
+    if (options.dims.empty()) {
+        std::cerr << "--dims must not be empty" << std::endl;
+        return 1;
+    }
+    for (size_t dims: options.dims) {
+        if (dims < 2 || dims > 8) {
+            std::cerr << "dimensions must be between 2 and 8" << std::endl;
+            return 1;
+        }
+    }
+    if (options.dists.empty()) {
+        std::cerr << "--dist must not be empty" << std::endl;
+        return 1;
+    }
+    for (auto& dist: options.dists) {
+        if (dist != "uniform" && dist != "clustered" && dist != "sorted") {
+            std::cerr << "unknown distribution " << dist << std::endl;
+            return 1;
+        }
+    }
+    // the range accepted by KDTree::setBalanceFactor
+    if (options.balance != 0 && !(options.balance > 0.5 && options.balance < 1)) {
+        std::cerr << "--balance must be 0 or in (0.5, 1)" << std::endl;
+        return 1;
+    }
+
+    std::cout << options.n << " points";
+    if (options.balance > 0) {
+        std::cout << ", insert rebalanced with alpha " << options.balance;
+    }
+    std::cout << std::endl;
+    std::cout << std::setw(5) << "dims" << "  " << std::left << std::setw(11) << "dist" << std::setw(10) << "op"
+              << std::right << std::setw(10) << "Mops/s" << std::setw(12) << "visits/op" << std::endl;
+    for (size_t dims: options.dims) {
+        switch (dims) {
+            case 2:
+                runDims<2>(options);
+                break;
+            case 3:
+                runDims<3>(options);
+                break;
+            case 4:
+                runDims<4>(options);
+                break;
+            case 5:
+                runDims<5>(options);
+                break;
+            case 6:
+                runDims<6>(options);
+                break;
+            case 7:
+                runDims<7>(options);
+                break;
+            case 8:
+                runDims<8>(options);
+                break;
+            default:
+                std::cerr << "dimensions must be between 2 and 8" << std::endl;
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,680 @@
+#pragma once
+
+#include "kdtree.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * An abstract template base of the ImplicitKDTree class
+ */
+template<typename...>
+class ImplicitKDTree;
+
+/**
+ * An abstract template base of the KDForest class
+ */
+template<typename...>
+class KDForest;
+
+/**
+ * An immutable, read-optimized KDTree without pointers
+ * The internal nodes form a complete binary tree stored in BFS order (children of node i are
+ * 2i + 1 and 2i + 2), and the points are stored in leaf buckets of at most LeafSize points
+ * Split values and points are stored as a structure of arrays (one array per dimension), so a
+ * leaf bucket is scanned by simple loops over contiguous columns that the compiler vectorizes
+ * Split dimensions cycle with the depth, or are drawn among the dimensions of largest spread
+ * when a seed is given (randomized trees, see KDForest)
+ * The time complexity of functions are based on n and k
+ * n is the size of the tree
+ * k is the number of dimensions
+ * @typedef Key         key type
+ * @typedef Value       value type
+ * @static  KeySize     k (number of dimensions)
+ * @static  LeafSize    maximum number of points in a leaf bucket
+ */
+template<typename ValueType, typename... KeyTypes>
+class ImplicitKDTree<std::tuple<KeyTypes...>, ValueType> {
+public:
+    typedef std::tuple<KeyTypes...> Key;
+    typedef ValueType Value;
+    typedef std::pair<Key, Value> Entry;
+    static inline constexpr size_t KeySize = std::tuple_size<Key>::value;
+    static inline constexpr size_t LeafSize = 32;
+    static_assert(KeySize > 0, "Can not construct ImplicitKDTree with zero dimension");
+    static_assert(KeySize < 256, "split dimensions are stored in a byte");
+
+    /**
+     * A result of nearest, distance is the finalized distance to the query key
+     */
+    struct Neighbor {
+        double distance;
+        Key key;
+        const Value* value;
+    };
+
+    template<typename...>
+    friend class KDForest;
+
+protected:
+    static inline constexpr size_t RandomDims = 5; // a randomized split picks one of the RandomDims widest dimensions
+    static inline constexpr bool Arithmetic = (std::is_arithmetic<KeyTypes>::value && ...);
+
+    size_t treeSize = 0; // number of points
+    size_t leafCount = 1; // number of leaf buckets, a power of two
+    std::vector<uint8_t> splitDims; // [node] = split dimension of the internal node
+    std::tuple<std::vector<KeyTypes>...> splits; // [dim][node] = split value if splitDims[node] == dim
+    std::vector<size_t> leafBegin; // points of leaf l are [leafBegin[l], leafBegin[l + 1])
+    std::tuple<std::vector<KeyTypes>...> coords; // [dim][point] = coordinate of the point
+    std::vector<Value> values; // [point] = value of the point
+    Key boundLo, boundHi; // bounding box of all points
+
+    /**
+     * Call f(std::integral_constant<size_t, DIM>()) with DIM == dim
+     * Time Complexity: O(k)
+     */
+    template<typename F, size_t... DIMS>
+    static void withDim(size_t dim, F f, std::index_sequence<DIMS...>) {
+        (void)((dim == DIMS ? (f(std::integral_constant<size_t, DIMS>()), true) : false) || ...);
+    }
+
+    template<typename F>
+    static void withDim(size_t dim, F f) {
+        withDim(dim, f, std::make_index_sequence<KeySize>());
+    }
+
+    template<typename F, size_t... DIMS>
+    static void forDims(F f, std::index_sequence<DIMS...>) {
+        (f(std::integral_constant<size_t, DIMS>()), ...);
+    }
+
+    template<typename F>
+    static void forDims(F f) {
+        forDims(f, std::make_index_sequence<KeySize>());
+    }
+
+    template<size_t... DIMS>
+    Key keyAt(size_t point, std::index_sequence<DIMS...>) const {
+        return Key(std::get<DIMS>(coords)[point]...);
+    }
+
+    /**
+     * @return the key of the point at index point, gathered from the columns
+     */
+    Key keyAt(size_t point) const {
+        return keyAt(point, std::make_index_sequence<KeySize>());
+    }
+
+    bool isLeaf(size_t node) const {
+        return node + 1 >= leafCount;
+    }
+
+    size_t leafOf(size_t node) const {
+        return node + 1 - leafCount;
+    }
+
+    /**
+     * Draw a split dimension among the RandomDims dimensions with the largest spread of [first, last)
+     * Time Complexity: O(k (last - first))
+     */
+    static size_t randomSplitDim(const Entry* first, const Entry* last, std::mt19937_64& random) {
+        std::pair<double, size_t> spreads[KeySize]; // (-spread, dim), widest first once sorted
+        forDims([&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            double lo = 0, hi = 0;
+            if (first != last) {
+                lo = hi = static_cast<double>(std::get<DIM>(first->first));
+            }
+            for (const Entry* entry = first; entry != last; entry++) {
+                double x = static_cast<double>(std::get<DIM>(entry->first));
+                lo = std::min(lo, x);
+                hi = std::max(hi, x);
+            }
+            spreads[DIM] = { lo - hi, DIM };
+        });
+        size_t candidates = std::min(RandomDims, KeySize);
+        std::partial_sort(spreads, spreads + candidates, spreads + KeySize);
+        return spreads[std::uniform_int_distribution<size_t>(0, candidates - 1)(random)].second;
+    }
+
+    /**
+     * Partition [first, last) at the median of the split dimension of node, recursively
+     * Ties are broken by the whole key, like KDTree::compareKey
+     * Time Complexity: O(n log n), O(kn log n) if randomized
+     * @param random generator of randomized split dimensions, nullptr to cycle with the depth
+     */
+    void build(size_t node, size_t depth, Entry* base, Entry* first, Entry* last, std::mt19937_64* random) {
+        if (isLeaf(node)) {
+            leafBegin[leafOf(node)] = static_cast<size_t>(first - base);
+            return;
+        }
+        size_t dim = depth % KeySize;
+        if constexpr (Arithmetic) {
+            if (random) {
+                dim = randomSplitDim(first, last, *random);
+            }
+        }
+        Entry* median = first + (last - first) / 2;
+        splitDims[node] = static_cast<uint8_t>(dim);
+        withDim(dim, [&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            std::nth_element(first, median, last, [](const Entry& a, const Entry& b) {
+                if (std::get<DIM>(a.first) != std::get<DIM>(b.first)) {
+                    return std::get<DIM>(a.first) < std::get<DIM>(b.first);
+                }
+                return a.first < b.first;
+            });
+            // an empty right half keeps the left half below the split value
+            std::get<DIM>(splits)[node] =
+                median != last ? std::get<DIM>(median->first) : std::get<DIM>(boundHi);
+        });
+        build(2 * node + 1, depth + 1, base, first, median, random);
+        build(2 * node + 2, depth + 1, base, median, last, random);
+    }
+
+    /**
+     * Scan a leaf bucket for key
+     * The columns are compared one dimension at a time into a match mask
+     * Time Complexity: O(k LeafSize), vectorized
+     * @return index of the point, or treeSize if not found
+     */
+    size_t findInLeaf(size_t leaf, const Key& key) const {
+        size_t begin = leafBegin[leaf], length = leafBegin[leaf + 1] - begin;
+        uint8_t match[LeafSize];
+        std::fill(match, match + length, 1);
+        forDims([&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            auto column = std::get<DIM>(coords).data() + begin;
+            auto value = std::get<DIM>(key);
+            for (size_t i = 0; i < length; i++) {
+                match[i] &= static_cast<uint8_t>(column[i] == value);
+            }
+        });
+        for (size_t i = 0; i < length; i++) {
+            if (match[i]) {
+                return begin + i;
+            }
+        }
+        return treeSize;
+    }
+
+    /**
+     * Time Complexity: O(k log n), both children are searched only when key lies on the split
+     * @return index of the point, or treeSize if not found
+     */
+    size_t find(size_t node, const Key& key) const {
+        while (!isLeaf(node)) {
+            size_t dim = splitDims[node];
+            int side = 0; // -1 left, 1 right, 0 both
+            withDim(dim, [&](auto d) {
+                constexpr size_t DIM = decltype(d)::value;
+                auto split = std::get<DIM>(splits)[node];
+                side = std::get<DIM>(key) < split ? -1 : split < std::get<DIM>(key) ? 1 : 0;
+            });
+            if (side == 0) {
+                size_t point = find(2 * node + 1, key);
+                return point != treeSize ? point : find(2 * node + 2, key);
+            }
+            node = side < 0 ? 2 * node + 1 : 2 * node + 2;
+        }
+        return findInLeaf(leafOf(node), key);
+    }
+
+    /**
+     * Visit (or count) the points in [lo, hi] in the subtree of node, whose cell is [cellLo, cellHi]
+     * A cell inside [lo, hi] is handled as a contiguous run of points without any check
+     * Time Complexity: O(n^(1-1/k) + m)
+     * @tparam Visitor called with (index of point), or nothing if counting only
+     */
+    template<bool COUNT_ONLY, typename Visitor>
+    size_t range(
+        size_t node,
+        size_t firstLeaf,
+        size_t lastLeaf,
+        Key cellLo,
+        Key cellHi,
+        const Key& lo,
+        const Key& hi,
+        Visitor& visitor
+    ) const {
+        if (KDTree<Key, Value>::boxInside(cellLo, cellHi, lo, hi)) {
+            size_t begin = leafBegin[firstLeaf], end = leafBegin[lastLeaf + 1];
+            if constexpr (!COUNT_ONLY) {
+                for (size_t i = begin; i < end; i++) {
+                    visitor(i);
+                }
+            }
+            return end - begin;
+        }
+        if (!KDTree<Key, Value>::boxIntersect(cellLo, cellHi, lo, hi)) {
+            return 0;
+        }
+        if (isLeaf(node)) {
+            return scanLeaf<COUNT_ONLY>(firstLeaf, lo, hi, visitor);
+        }
+        size_t middleLeaf = firstLeaf + (lastLeaf - firstLeaf) / 2;
+        size_t count = 0;
+        withDim(splitDims[node], [&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            auto split = std::get<DIM>(splits)[node];
+            Key leftHi = cellHi, rightLo = cellLo;
+            std::get<DIM>(leftHi) = split;
+            std::get<DIM>(rightLo) = split;
+            count += range<COUNT_ONLY>(2 * node + 1, firstLeaf, middleLeaf, cellLo, leftHi, lo, hi, visitor);
+            count += range<COUNT_ONLY>(2 * node + 2, middleLeaf + 1, lastLeaf, rightLo, cellHi, lo, hi, visitor);
+        });
+        return count;
+    }
+
+    /**
+     * Test all points of a leaf bucket against [lo, hi], one column at a time
+     * Time Complexity: O(k LeafSize), vectorized
+     */
+    template<bool COUNT_ONLY, typename Visitor>
+    size_t scanLeaf(size_t leaf, const Key& lo, const Key& hi, Visitor& visitor) const {
+        size_t begin = leafBegin[leaf], length = leafBegin[leaf + 1] - begin;
+        uint8_t inside[LeafSize];
+        std::fill(inside, inside + length, 1);
+        forDims([&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            auto column = std::get<DIM>(coords).data() + begin;
+            auto low = std::get<DIM>(lo), high = std::get<DIM>(hi);
+            for (size_t i = 0; i < length; i++) {
+                inside[i] &= static_cast<uint8_t>(!(column[i] < low) & !(high < column[i]));
+            }
+        });
+        size_t count = 0;
+        for (size_t i = 0; i < length; i++) {
+            if constexpr (!COUNT_ONLY) {
+                if (inside[i]) {
+                    visitor(begin + i);
+                }
+            }
+            count += inside[i];
+        }
+        return count;
+    }
+
+    /**
+     * A subtree waiting in the queue of search, whose cell is [cellLo, cellHi]
+     */
+    struct Branch {
+        double bound; // unfinalized distance from the query key to the cell
+        const ImplicitKDTree* tree;
+        size_t node;
+        Key cellLo, cellHi;
+
+        bool operator<(const Branch& that) const {
+            return bound > that.bound; // the nearest cell on top of the heap
+        }
+    };
+
+    /**
+     * A point found by search
+     */
+    struct Candidate {
+        double distance; // unfinalized
+        const ImplicitKDTree* tree;
+        size_t point;
+
+        bool operator<(const Candidate& that) const {
+            return distance < that.distance; // the farthest candidate on top of the heap
+        }
+    };
+
+    /**
+     * Offer a point to the k nearest candidates, a point found before in another tree (same
+     * distance and key) is ignored
+     * Time Complexity: O(log k), O(k) if the distance is tied
+     */
+    static void offer(std::vector<Candidate>& best, size_t k, const Candidate& candidate) {
+        if (best.size() == k && !(candidate.distance < best.front().distance)) {
+            return;
+        }
+        for (auto& other: best) {
+            if (other.distance == candidate.distance && other.tree != candidate.tree
+                && other.tree->keyAt(other.point) == candidate.tree->keyAt(candidate.point)) {
+                return;
+            }
+        }
+        if (best.size() == k) {
+            std::pop_heap(best.begin(), best.end());
+            best.pop_back();
+        }
+        best.push_back(candidate);
+        std::push_heap(best.begin(), best.end());
+    }
+
+    /**
+     * Offer all points of a leaf bucket, distances are computed one column at a time
+     * Time Complexity: O(k LeafSize) vectorized, plus O(LeafSize log k)
+     */
+    template<typename Metric>
+    void scanNearest(size_t leaf, const Key& key, size_t k, std::vector<Candidate>& best) const {
+        size_t begin = leafBegin[leaf], length = leafBegin[leaf + 1] - begin;
+        double distances[LeafSize];
+        std::fill(distances, distances + length, 0.0);
+        forDims([&](auto d) {
+            constexpr size_t DIM = decltype(d)::value;
+            auto column = std::get<DIM>(coords).data() + begin;
+            double center = static_cast<double>(std::get<DIM>(key));
+            for (size_t i = 0; i < length; i++) {
+                distances[i] = Metric::combine(distances[i], Metric::axis(static_cast<double>(column[i]) - center));
+            }
+        });
+        for (size_t i = 0; i < length; i++) {
+            offer(best, k, { distances[i], this, begin + i });
+        }
+    }
+
+    /**
+     * Best-bin-first k nearest neighbor search over one or several trees with a shared queue
+     * Each step pops the cell nearest to key, descends to its nearest leaf (queueing the far
+     * children) and scans the leaf. The search stops once the nearest queued cell is farther
+     * than the k-th nearest point found divided by 1 + eps, or after maxLeaves leaves
+     * Time Complexity: O(min(maxLeaves, n / LeafSize) (k LeafSize + log n))
+     * @param trees
+     * @param treeCount
+     * @return the (at most) k nearest points found, from the nearest to the farthest
+     */
+    template<typename Metric>
+    static std::vector<Neighbor> search(
+        const ImplicitKDTree* const* trees,
+        size_t treeCount,
+        const Key& key,
+        size_t k,
+        double eps,
+        size_t maxLeaves
+    ) {
+        std::vector<Branch> queue;
+        std::vector<Candidate> best;
+        if (k == 0 || maxLeaves == 0) {
+            return {};
+        }
+        for (size_t t = 0; t < treeCount; t++) {
+            const ImplicitKDTree* tree = trees[t];
+            if (tree->treeSize > 0) {
+                double bound = KDTree<Key, Value>::template boxDistance<Metric, false>(key, tree->boundLo, tree->boundHi);
+                queue.push_back({ bound, tree, 0, tree->boundLo, tree->boundHi });
+                std::push_heap(queue.begin(), queue.end());
+            }
+        }
+        const double factor = Metric::axis(1 + eps);
+        size_t leaves = 0;
+        while (!queue.empty()) {
+            std::pop_heap(queue.begin(), queue.end());
+            Branch branch = std::move(queue.back());
+            queue.pop_back();
+            if (best.size() == k && branch.bound * factor >= best.front().distance) {
+                break;
+            }
+            const ImplicitKDTree* tree = branch.tree;
+            size_t node = branch.node;
+            while (!tree->isLeaf(node)) {
+                withDim(tree->splitDims[node], [&](auto d) {
+                    constexpr size_t DIM = decltype(d)::value;
+                    auto split = std::get<DIM>(tree->splits)[node];
+                    bool left = std::get<DIM>(key) < split;
+                    Branch far { 0, tree, left ? 2 * node + 2 : 2 * node + 1, branch.cellLo, branch.cellHi };
+                    std::get<DIM>(left ? far.cellLo : far.cellHi) = split;
+                    std::get<DIM>(left ? branch.cellHi : branch.cellLo) = split;
+                    far.bound = KDTree<Key, Value>::template boxDistance<Metric, false>(key, far.cellLo, far.cellHi);
+                    if (best.size() < k || far.bound * factor < best.front().distance) {
+                        queue.push_back(std::move(far));
+                        std::push_heap(queue.begin(), queue.end());
+                    }
+                    node = left ? 2 * node + 1 : 2 * node + 2;
+                });
+            }
+            tree->template scanNearest<Metric>(tree->leafOf(node), key, k, best);
+            if (++leaves == maxLeaves) {
+                break;
+            }
+        }
+        std::sort_heap(best.begin(), best.end());
+        std::vector<Neighbor> result;
+        result.reserve(best.size());
+        for (auto& candidate: best) {
+            result.push_back({ Metric::finalize(candidate.distance), candidate.tree->keyAt(candidate.point),
+                               &candidate.tree->values[candidate.point] });
+        }
+        return result;
+    }
+
+    static std::vector<Entry> entries(KDTree<Key, Value>& tree) {
+        std::vector<Entry> v;
+        v.reserve(tree.size());
+        for (auto& data: tree) {
+            v.emplace_back(data.first, data.second);
+        }
+        return v;
+    }
+
+public:
+    ImplicitKDTree(): leafBegin(2, 0) {}
+
+    /**
+     * If a key appears several times, the last value is kept
+     * Time complexity: O(kn log n)
+     * @param v we pass by value here because v need to be modified
+     * @param seed 0 to cycle the split dimensions, otherwise the seed of randomized splits
+     * (all KeyTypes must be arithmetic, or the seed is ignored)
+     */
+    explicit ImplicitKDTree(std::vector<Entry> v, uint64_t seed = 0) {
+        std::stable_sort(v.begin(), v.end(), [](const Entry& a, const Entry& b) {
+            return a.first < b.first;
+        });
+        auto it = std::unique(v.rbegin(), v.rend(), [](const Entry& a, const Entry& b) {
+            return a.first == b.first;
+        });
+        v.erase(v.begin(), it.base());
+        treeSize = v.size();
+        while (leafCount * LeafSize < treeSize) {
+            leafCount *= 2;
+        }
+        if (!v.empty()) {
+            boundLo = boundHi = v.front().first;
+            for (auto& entry: v) {
+                KDTree<Key, Value>::expandBox(boundLo, boundHi, entry.first, entry.first);
+            }
+        }
+        splitDims.resize(leafCount - 1);
+        forDims([&](auto d) {
+            std::get<decltype(d)::value>(splits).resize(leafCount - 1);
+            std::get<decltype(d)::value>(coords).resize(treeSize);
+        });
+        leafBegin.resize(leafCount + 1);
+        leafBegin[leafCount] = treeSize;
+        std::mt19937_64 random(seed);
+        build(0, 0, v.data(), v.data(), v.data() + v.size(), seed ? &random : nullptr);
+        values.reserve(treeSize);
+        for (size_t i = 0; i < treeSize; i++) {
+            forDims([&](auto d) {
+                constexpr size_t DIM = decltype(d)::value;
+                std::get<DIM>(coords)[i] = std::get<DIM>(v[i].first);
+            });
+            values.push_back(std::move(v[i].second));
+        }
+    }
+
+    /**
+     * Build from the content of a KDTree
+     * Time complexity: O(kn log n)
+     */
+    explicit ImplicitKDTree(KDTree<Key, Value>& tree, uint64_t seed = 0): ImplicitKDTree(entries(tree), seed) {}
+
+    size_t size() const {
+        return treeSize;
+    }
+
+    /**
+     * Time complexity: O(k log n)
+     * @param key
+     * @return pointer to the value of key, or nullptr if not found
+     */
+    const Value* find(const Key& key) const {
+        if (treeSize == 0) {
+            return nullptr;
+        }
+        size_t point = find(0, key);
+        return point != treeSize ? &values[point] : nullptr;
+    }
+
+    /**
+     * Visit all points with a key in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k) + m), m is the number of keys in the box
+     * @param visitor called with (const Key&, const Value&) of each point in the box
+     */
+    template<typename Visitor>
+    void range(const Key& lo, const Key& hi, Visitor visitor) const {
+        if (treeSize == 0) {
+            return;
+        }
+        auto visitPoint = [&](size_t point) {
+            visitor(keyAt(point), values[point]);
+        };
+        range<false>(0, 0, leafCount - 1, boundLo, boundHi, lo, hi, visitPoint);
+    }
+
+    /**
+     * Count the keys in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k))
+     */
+    size_t rangeCount(const Key& lo, const Key& hi) const {
+        if (treeSize == 0) {
+            return 0;
+        }
+        auto none = [](size_t) {};
+        return range<true>(0, 0, leafCount - 1, boundLo, boundHi, lo, hi, none);
+    }
+
+    /**
+     * Find the (approximate) k nearest neighbors of key, all KeyTypes must be arithmetic
+     * With eps = 0 and no leaf budget the result is exact, otherwise every returned point is
+     * within (1 + eps) times the distance of the true neighbor of its rank, unless the budget
+     * ran out first
+     * Time complexity: O(log n + k) on average for small dimensions, bounded by the budget
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @param key
+     * @param k
+     * @param eps approximation factor, larger prunes more
+     * @param maxLeaves maximum number of leaf buckets scanned
+     * @return the (at most) k nearest points found, from the nearest to the farthest
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<Neighbor> nearest(const Key& key, size_t k, double eps = 0, size_t maxLeaves = SIZE_MAX) const {
+        const ImplicitKDTree* self = this;
+        return search<Metric>(&self, 1, key, k, eps, maxLeaves);
+    }
+
+    /**
+     * Recall of an approximate neighbor list, i.e. the fraction of the exact neighbors found
+     * Time complexity: O(k^2)
+     * @return 1 if exact is empty
+     */
+    static double recall(const std::vector<Neighbor>& approx, const std::vector<Neighbor>& exact) {
+        if (exact.empty()) {
+            return 1;
+        }
+        size_t found = 0;
+        for (auto& neighbor: exact) {
+            found += std::any_of(approx.begin(), approx.end(), [&](const Neighbor& other) {
+                return other.key == neighbor.key;
+            });
+        }
+        return static_cast<double>(found) / static_cast<double>(exact.size());
+    }
+};
+
+/**
+ * A randomized KD forest for approximate nearest neighbor search in higher dimensions
+ * (Silpa-Anan and Hartley, "Optimised KD-trees for fast image descriptor matching")
+ * The trees index the same points with different randomized split dimensions, and are searched
+ * together best-bin-first with one queue and one leaf budget, so a neighbor missed by the
+ * cells of one tree is likely found early in another
+ * Each tree stores the index of the value, the values are stored once
+ * @typedef Key         key type
+ * @typedef Value       value type
+ */
+template<typename ValueType, typename... KeyTypes>
+class KDForest<std::tuple<KeyTypes...>, ValueType> {
+public:
+    typedef std::tuple<KeyTypes...> Key;
+    typedef ValueType Value;
+    typedef std::pair<Key, Value> Entry;
+    typedef ImplicitKDTree<Key, size_t> Tree;
+    typedef typename ImplicitKDTree<Key, Value>::Neighbor Neighbor;
+
+protected:
+    std::vector<Tree> trees;
+    std::vector<Value> values; // [index] = value of the point with index
+
+public:
+    /**
+     * If a key appears several times, the last value is kept
+     * Time complexity: O(t kn log n) for t trees
+     * @param v we pass by value here because v need to be modified
+     * @param treeCount number of randomized trees, at least 1
+     * @param seed
+     */
+    KDForest(std::vector<Entry> v, size_t treeCount, uint64_t seed = 1) {
+        std::stable_sort(v.begin(), v.end(), [](const Entry& a, const Entry& b) {
+            return a.first < b.first;
+        });
+        auto it = std::unique(v.rbegin(), v.rend(), [](const Entry& a, const Entry& b) {
+            return a.first == b.first;
+        });
+        v.erase(v.begin(), it.base());
+        std::vector<typename Tree::Entry> indices;
+        indices.reserve(v.size());
+        values.reserve(v.size());
+        for (auto& entry: v) {
+            indices.emplace_back(entry.first, values.size());
+            values.push_back(std::move(entry.second));
+        }
+        std::mt19937_64 seeds(seed);
+        trees.reserve(std::max<size_t>(treeCount, 1));
+        for (size_t t = 0; t < std::max<size_t>(treeCount, 1); t++) {
+            trees.emplace_back(indices, seeds() | 1);
+        }
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    size_t treeCount() const {
+        return trees.size();
+    }
+
+    /**
+     * Find the approximate k nearest neighbors of key over all trees
+     * Time complexity: bounded by the leaf budget shared by all trees
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @param key
+     * @param k
+     * @param eps approximation factor, larger prunes more
+     * @param maxLeaves maximum number of leaf buckets scanned in all trees together
+     * @return the (at most) k nearest points found, from the nearest to the farthest
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<Neighbor> nearest(const Key& key, size_t k, double eps = 0, size_t maxLeaves = SIZE_MAX) const {
+        std::vector<const Tree*> pointers;
+        for (auto& tree: trees) {
+            pointers.push_back(&tree);
+        }
+        auto found = Tree::template search<Metric>(pointers.data(), pointers.size(), key, k, eps, maxLeaves);
+        std::vector<Neighbor> result;
+        result.reserve(found.size());
+        for (auto& neighbor: found) {
+            result.push_back({ neighbor.distance, neighbor.key, &values[*neighbor.value] });
+        }
+        return result;
+    }
+};
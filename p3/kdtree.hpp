@@ -1,16 +1,163 @@
+#pragma once
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <queue>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/**
+ * Traversal counters of KDTree, only updated when compiled with -DKDTREE_INSTRUMENTATION
+ * Every node reached by an operation counts as one visit, in a counter of the calling thread
+ */
+namespace KDTreeInstrumentation {
+    inline size_t& visits() {
+        thread_local size_t count = 0;
+        return count;
+    }
+}
+
+#ifdef KDTREE_INSTRUMENTATION
+    #define KDTREE_COUNT_VISIT() (++KDTreeInstrumentation::visits())
+#else
+    #define KDTREE_COUNT_VISIT() ((void)0)
+#endif
+
+/**
+ * Shape of a KDTree, see KDTree::shapeStats
+ */
+struct KDTreeShape {
+    size_t nodes = 0; // dead nodes included
+    size_t maxDepth = 0; // depth of the deepest node, the root is at depth 0
+    double averageDepth = 0; // over all nodes
+    std::vector<size_t> depthHistogram; // [d] = number of nodes at depth d
+    // [b] = number of nodes with at least 2 nodes below whose larger subtree holds between b / 10
+    // and (b + 1) / 10 of them (b = 5 is balanced, b = 9 is a path)
+    std::vector<size_t> balanceHistogram = std::vector<size_t>(10);
+};
+
+/**
+ * Distance metrics for KDTree::nearest
+ * A metric combines the per-dimension terms axis(a_i - b_i) into a distance, which is
+ * turned into the real distance by finalize (e.g. L2 sums squares, then takes the root)
+ * axis(d) is also a lower bound of the distance to any point beyond a splitting plane at d
+ */
+namespace KDTreeMetric {
+    struct L2 {
+        static double axis(double d) {
+            return d * d;
+        }
+
+        static double combine(double a, double b) {
+            return a + b;
+        }
+
+        static double finalize(double distance) {
+            return std::sqrt(distance);
+        }
+    };
+
+    struct L1 {
+        static double axis(double d) {
+            return std::abs(d);
+        }
+
+        static double combine(double a, double b) {
+            return a + b;
+        }
+
+        static double finalize(double distance) {
+            return distance;
+        }
+    };
+
+    struct LInf {
+        static double axis(double d) {
+            return std::abs(d);
+        }
+
+        static double combine(double a, double b) {
+            return std::max(a, b);
+        }
+
+        static double finalize(double distance) {
+            return distance;
+        }
+    };
+}
+
 /**
  * An abstract template base of the KDTree class
  */
 template<typename...>
 class KDTree;
 
+template<typename...>
+class ImplicitKDTree;
+
+template<typename...>
+class MappedKDTree;
+
+/**
+ * The on-disk image of a KDTree, written by KDTree::save and served by MappedKDTree
+ * The header is followed by one fixed-size record per node in pre-order, so every subtree is a
+ * contiguous run of records: the left child of record i is record i + 1 and the right subtree
+ * starts at the index stored in the record
+ */
+struct KDTreeSnapshotHeader {
+    static constexpr char MAGIC[8] = { 'K', 'D', 'S', 'N', 'A', 'P', '0', '1' };
+
+    char magic[8];
+    uint32_t keySize; // sizeof(Key), to reject images of another key type
+    uint32_t valueSize; // sizeof(Value), to reject images of another value type
+    uint32_t dimensions;
+    uint32_t recordSize;
+    uint64_t treeSize; // number of live nodes
+    uint64_t nodeCount; // number of records, dead nodes included
+    uint64_t recordOffset; // byte offset of the first record
+
+    /**
+     * Only the header is checked, MappedKDTree checks the indices of each record as it reads it
+     * @throw std::runtime_error if the image is not a snapshot of the expected types, or if it
+     *        is truncated
+     * @return the validated header at the beginning of the image
+     */
+    static const KDTreeSnapshotHeader&
+    check(const char* data, size_t size, size_t keySize, size_t valueSize, size_t dimensions, size_t recordSize) {
+        if (size < sizeof(KDTreeSnapshotHeader)) {
+            throw std::runtime_error("truncated kdtree snapshot");
+        }
+        auto& header = *reinterpret_cast<const KDTreeSnapshotHeader*>(data);
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.keySize != keySize
+            || header.valueSize != valueSize || header.dimensions != dimensions
+            || header.recordSize != recordSize)
+        {
+            throw std::runtime_error("not a kdtree snapshot of this type");
+        }
+        // compare counts rather than byte sizes, so that a corrupt count can not overflow
+        if (header.recordOffset < sizeof(header) || header.recordOffset > size
+            || header.nodeCount > (size - header.recordOffset) / recordSize
+            || header.treeSize > header.nodeCount)
+        {
+            throw std::runtime_error("truncated kdtree snapshot");
+        }
+        return header;
+    }
+};
+
 /**
  * A partial template specialization of the KDTree class
  * The time complexity of functions are based on n and k
@@ -20,6 +167,9 @@ class KDTree;
  * @typedef Value       value type
  * @typedef Data        key-value pair
  * @static  KeySize     k (number of dimensions)
+ * The const members (begin, end, find, findMin, findMax, nearest, range, withinRadius,
+ * queryBatch, ...) never modify the tree, so any number of threads may call them concurrently,
+ * as long as no thread modifies the tree at the same time
  */
 template<typename ValueType, typename... KeyTypes>
 class KDTree<std::tuple<KeyTypes...>, ValueType> {
@@ -27,25 +177,140 @@ public:
     typedef std::tuple<KeyTypes...> Key;
     typedef ValueType Value;
     typedef std::pair<const Key, Value> Data;
+    typedef std::pair<Key, Value> Entry; // a mutable key-value pair, used to build a tree
     static inline constexpr size_t KeySize = std::tuple_size<Key>::value;
     static_assert(KeySize > 0, "Can not construct KDTree with zero dimension");
 
+    /**
+     * A read-only query of queryBatch
+     * FIND looks up key, MIN / MAX find the minimum / maximum on dimension dim (key is ignored)
+     */
+    struct Query {
+        enum Kind { FIND, MIN, MAX } kind = FIND;
+        Key key {};
+        size_t dim = 0;
+    };
+
+    template<typename...>
+    friend class ImplicitKDTree;
+
+    template<typename...>
+    friend class MappedKDTree;
+
 protected:
     struct Node {
         Data data;
         Node* parent;
         Node* left = nullptr;
         Node* right = nullptr;
+        Key lo, hi; // bounding box of the live keys of the subtree, invalid if count is 0
+        size_t count = 1; // number of live nodes in the subtree
+        bool dead = false; // erased in tombstone mode, kept until the next compaction
 
-        Node(const Key& key, const Value& value, Node* parent): data(key, value), parent(parent) {}
+        Node(const Key& key, const Value& value, Node* parent):
+            data(key, value),
+            parent(parent),
+            lo(key),
+            hi(key) {}
 
-        const Key& key() {
+        const Key& key() const {
             return data.first;
         }
 
         Value& value() {
             return data.second;
         }
+
+        const Value& value() const {
+            return data.second;
+        }
+    };
+
+    /**
+     * Arena of nodes, allocated in chunked slabs
+     * Erased nodes go to a free list and are reused by later insertions
+     * Blocks of contiguous nodes can be taken for bulk builds and copies
+     */
+    class NodePool {
+    public:
+        struct alignas(Node) Slot {
+            unsigned char bytes[sizeof(Node)];
+        };
+
+    private:
+        static constexpr size_t MIN_CHUNK = 64; // size of the first chunk
+        static constexpr size_t MAX_CHUNK = 1 << 16; // chunks grow geometrically up to this
+
+        std::vector<std::unique_ptr<Slot[]>> chunks;
+        Slot* next = nullptr; // first unused slot of the last chunk
+        Slot* last = nullptr; // end of the last chunk
+        size_t chunkSize = MIN_CHUNK;
+        Slot* freeList = nullptr; // destroyed slots, linked through their first bytes
+
+    public:
+        NodePool() = default;
+
+        NodePool(const NodePool&) = delete;
+
+        NodePool& operator=(const NodePool&) = delete;
+
+        /**
+         * Take raw storage of n contiguous nodes, construct them with construct
+         * Time complexity: O(1)
+         */
+        Slot* allocate(size_t n) {
+            if (static_cast<size_t>(last - next) < n) {
+                size_t size = std::max(n, chunkSize);
+                chunkSize = std::min(chunkSize * 2, MAX_CHUNK);
+                chunks.emplace_back(new Slot[size]);
+                next = chunks.back().get();
+                last = next + size;
+            }
+            Slot* block = next;
+            next += n;
+            return block;
+        }
+
+        template<typename... Args>
+        static Node* construct(Slot* slot, Args&&... args) {
+            return new (slot) Node(std::forward<Args>(args)...);
+        }
+
+        /**
+         * Create a node, reusing a destroyed one if possible
+         * Time complexity: O(1)
+         */
+        template<typename... Args>
+        Node* create(Args&&... args) {
+            Slot* slot = freeList;
+            if (slot) {
+                std::memcpy(&freeList, slot, sizeof(Slot*));
+            } else {
+                slot = allocate(1);
+            }
+            return construct(slot, std::forward<Args>(args)...);
+        }
+
+        /**
+         * Destroy a node and put it on the free list
+         * Time complexity: O(1)
+         */
+        void destroy(Node* node) {
+            node->~Node();
+            auto slot = reinterpret_cast<Slot*>(node);
+            std::memcpy(slot, &freeList, sizeof(Slot*));
+            freeList = slot;
+        }
+
+        /**
+         * Release all chunks at once, the nodes must have been destructed if necessary
+         * Time complexity: O(number of chunks)
+         */
+        void release() {
+            chunks.clear();
+            next = last = freeList = nullptr;
+            chunkSize = MIN_CHUNK;
+        }
     };
 
 public:
@@ -61,10 +326,16 @@ public:
         Iterator(KDTree* tree, Node* node): tree(tree), node(node) {}
 
         /**
-         * Increment the iterator
-         * Time complexity: O(log n)
+         * Increment the iterator, skipping dead nodes
+         * Time complexity: O(log n) amortized if few nodes are dead
          */
         void increment() {
+            do {
+                step();
+            } while (node && node->dead);
+        }
+
+        void step() {
             if (!node) {
                 return;
             }
@@ -84,10 +355,16 @@ public:
         }
 
         /**
-         * Decrement the iterator
-         * Time complexity: O(log n)
+         * Decrement the iterator, skipping dead nodes
+         * Time complexity: O(log n) amortized if few nodes are dead
          */
         void decrement() {
+            do {
+                stepBack();
+            } while (node && node->dead);
+        }
+
+        void stepBack() {
             if (!node) {
                 return;
             }
@@ -145,18 +422,83 @@ public:
             return node != that.node;
         }
 
-        Data* operator->() {
+        Data* operator->() const {
             return &(node->data);
         }
 
-        Data& operator*() {
+        Data& operator*() const {
             return node->data;
         }
     };
 
+    /**
+     * A read-only bi-directional iterator, returned by the const members
+     * It only reads the nodes, so iterating from several threads at once is safe
+     */
+    class ConstIterator {
+    private:
+        Iterator it; // never writes through the tree or the nodes
+
+    public:
+        ConstIterator() = delete;
+
+        ConstIterator(const Iterator& it): it(it) {}
+
+        ConstIterator(const ConstIterator&) = default;
+
+        ConstIterator& operator=(const ConstIterator&) = default;
+
+        ConstIterator& operator++() {
+            ++it;
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator temp = *this;
+            ++it;
+            return temp;
+        }
+
+        ConstIterator& operator--() {
+            --it;
+            return *this;
+        }
+
+        ConstIterator operator--(int) {
+            ConstIterator temp = *this;
+            --it;
+            return temp;
+        }
+
+        bool operator==(const ConstIterator& that) const {
+            return it == that.it;
+        }
+
+        bool operator!=(const ConstIterator& that) const {
+            return it != that.it;
+        }
+
+        const Data* operator->() const {
+            return it.operator->();
+        }
+
+        const Data& operator*() const {
+            return *it;
+        }
+    };
+
 protected: // DO NOT USE private HERE!
+    typedef typename NodePool::Slot Slot;
+
+    NodePool pool; // storage of all nodes
     Node* root = nullptr; // root of the tree
     size_t treeSize = 0; // size of the tree
+    double balanceFactor = 0; // alpha of the weight balance, 0 if rebalancing is disabled
+    size_t maxTreeSize = 0; // maximum size since the last rebuild of the whole tree
+    Node** scapegoat = nullptr; // link to the highest unbalanced node of the last insertion
+    size_t scapegoatDim = 0; // dimension of that node
+    double tombstoneThreshold = 0; // dead ratio triggering a compaction, 0 if erasing eagerly
+    size_t deadCount = 0; // number of dead nodes
 
     /**
      * Find the node with key
@@ -167,21 +509,31 @@ protected: // DO NOT USE private HERE!
      * @return the node with key, or nullptr if not found
      */
     template<size_t DIM>
-    Node* find(const Key& key, Node* node) {
+    Node* find(const Key& key, Node* node) const {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
         if (!node) {
             return nullptr;
         }
+        KDTREE_COUNT_VISIT();
         if (key == node->key()) {
             return node;
         }
-        if (my_compareKey<DIM, std::less<>>(key, node->key())) {
+        if (compareKey<DIM, std::less<>>(key, node->key())) {
             return find<DIM_NEXT>(key, node->left);
         } else {
             return find<DIM_NEXT>(key, node->right);
         }
     }
 
+    /**
+     * Wrap a node for a const member
+     * Iterator only stores the tree pointer and never writes through it, so the const_cast
+     * does not lead to any modification
+     */
+    ConstIterator makeConstIterator(Node* node) const {
+        return Iterator(const_cast<KDTree*>(this), node);
+    }
+
     /**
      * Insert the key-value pair, if the key already exists, replace the value only
      * Time Complexity: O(k log n)
@@ -196,19 +548,39 @@ protected: // DO NOT USE private HERE!
     bool insert(const Key& key, const Value& value, Node*& node, Node* parent) {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
         if (!node) {
-            node = new Node(key, value, parent);
+            node = pool.create(key, value, parent);
             ++treeSize;
             return true;
         }
+        KDTREE_COUNT_VISIT();
         if (key == node->key()) {
             node->value() = value;
-            return false;
+            if (!node->dead) {
+                return false;
+            }
+            node->dead = false;
+            ++treeSize;
+            --deadCount;
+            pull(node);
+            return true;
         }
-        if (my_compareKey<DIM, std::less<>>(key, node->key())) {
-            return insert<DIM_NEXT>(key, value, node->left, node);
-        } else {
-            return insert<DIM_NEXT>(key, value, node->right, node);
+        bool inserted = compareKey<DIM, std::less<>>(key, node->key())
+                            ? insert<DIM_NEXT>(key, value, node->left, node)
+                            : insert<DIM_NEXT>(key, value, node->right, node);
+        if (inserted) {
+            if (node->count == 0) {
+                node->lo = node->hi = key;
+            } else {
+                expandBox(node->lo, node->hi, key, key);
+            }
+            ++node->count;
+            if (isUnbalanced(node)) {
+                // overwritten while unwinding, so the highest unbalanced node wins
+                scapegoat = &node;
+                scapegoatDim = DIM;
+            }
         }
+        return inserted;
     }
 
     /**
@@ -250,48 +622,60 @@ protected: // DO NOT USE private HERE!
 
     /**
      * Find the minimum node on a dimension
-     * Time Complexity: ?
+     * Only children whose cached box reaches the minimum of the subtree are searched, so the
+     * search is a single descent unless several keys share the minimum coordinate
+     * Time Complexity: O(log n) on a balanced tree with distinct coordinates on DIM_CMP
      * @tparam DIM_CMP comparison dimension
      * @tparam DIM current dimension of node
      * @param node
      * @return the minimum node on a dimension
      */
     template<size_t DIM_CMP, size_t DIM>
-    Node* findMin(Node* node) {
+    Node* findMin(Node* node) const {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
-        if (!node) {
+        if (!node || node->count == 0) {
             return nullptr;
         }
-        Node* min = findMin<DIM_CMP, DIM_NEXT>(node->left);
-        if (DIM != DIM_CMP) {
+        KDTREE_COUNT_VISIT();
+        const auto& target = std::get<DIM_CMP>(node->lo);
+        Node* min = nullptr;
+        if (node->left && node->left->count && !(target < std::get<DIM_CMP>(node->left->lo))) {
+            min = findMin<DIM_CMP, DIM_NEXT>(node->left);
+        }
+        if (node->right && node->right->count && !(target < std::get<DIM_CMP>(node->right->lo))) {
             min = compareNode<DIM_CMP, std::less<>>(min, findMin<DIM_CMP, DIM_NEXT>(node->right));
         }
-        return compareNode<DIM_CMP, std::less<>>(min, node);
+        return node->dead ? min : compareNode<DIM_CMP, std::less<>>(min, node);
     }
 
     /**
-     * Find the maximum node on a dimension
-     * Time Complexity: ?
+     * Find the maximum node on a dimension, see findMin
+     * Time Complexity: O(log n) on a balanced tree with distinct coordinates on DIM_CMP
      * @tparam DIM_CMP comparison dimension
      * @tparam DIM current dimension of node
      * @param node
      * @return the maximum node on a dimension
      */
     template<size_t DIM_CMP, size_t DIM>
-    Node* findMax(Node* node) {
+    Node* findMax(Node* node) const {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
-        if (!node) {
+        if (!node || node->count == 0) {
             return nullptr;
         }
-        Node* max = findMax<DIM_CMP, DIM_NEXT>(node->right);
-        if (DIM != DIM_CMP) {
+        KDTREE_COUNT_VISIT();
+        const auto& target = std::get<DIM_CMP>(node->hi);
+        Node* max = nullptr;
+        if (node->right && node->right->count && !(std::get<DIM_CMP>(node->right->hi) < target)) {
+            max = findMax<DIM_CMP, DIM_NEXT>(node->right);
+        }
+        if (node->left && node->left->count && !(std::get<DIM_CMP>(node->left->hi) < target)) {
             max = compareNode<DIM_CMP, std::greater<>>(max, findMax<DIM_CMP, DIM_NEXT>(node->left));
         }
-        return compareNode<DIM_CMP, std::greater<>>(max, node);
+        return node->dead ? max : compareNode<DIM_CMP, std::greater<>>(max, node);
     }
 
     template<size_t DIM>
-    Node* findMinDynamic(size_t dim) {
+    Node* findMinDynamic(size_t dim) const {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
         if (dim >= KeySize) {
             dim %= KeySize;
@@ -302,7 +686,7 @@ protected: // DO NOT USE private HERE!
     }
 
     template<size_t DIM>
-    Node* findMaxDynamic(size_t dim) {
+    Node* findMaxDynamic(size_t dim) const {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
         if (dim >= KeySize) {
             dim %= KeySize;
@@ -314,7 +698,7 @@ protected: // DO NOT USE private HERE!
 
     /**
      * Erase a node with key (check the pseudocode in project description)
-     * Time Complexity: max{O(k log n), O(findMin)}
+     * Time Complexity: O(log^2 n) on a balanced tree, each replacement is found by one descent
      * @tparam DIM current dimension of node
      * @param node
      * @param key
@@ -326,6 +710,7 @@ protected: // DO NOT USE private HERE!
         if (!node) {
             return nullptr;
         }
+        KDTREE_COUNT_VISIT();
         if (key == node->key()) {
             if (!node->left && !node->right) {
                 if (node->parent) {
@@ -337,7 +722,7 @@ protected: // DO NOT USE private HERE!
                 } else {
                     root = nullptr;
                 }
-                delete node;
+                pool.destroy(node);
                 --treeSize;
                 return nullptr;
             } else if (node->right) {
@@ -353,11 +738,12 @@ protected: // DO NOT USE private HERE!
                 node->value() = max->value();
                 node->left = erase<DIM_NEXT>(node->left, max->key());
             }
-        } else if (my_compareKey<DIM, std::less<>>(key, node->key())) {
+        } else if (compareKey<DIM, std::less<>>(key, node->key())) {
             node->left = erase<DIM_NEXT>(node->left, key);
         } else {
             node->right = erase<DIM_NEXT>(node->right, key);
         }
+        pull(node);
         return node;
     }
 
@@ -374,161 +760,1450 @@ protected: // DO NOT USE private HERE!
 
     // TODO: define your helper functions here if necessary
     template<size_t DIM>
-    static bool compareData(const Data& a, const Data& b) {
+    static bool compareData(const Entry& a, const Entry& b) {
         return compareKey<DIM, std::less<>>(a.first, b.first);
     }
 
-    template<size_t DIM>
-    Node* kdtree_build(std::vector<std::pair<Key, Value>> v, Node* parent) {
+    /**
+     * Build a subtree in place from the pairs in [first, last) (with unique keys)
+     * The median on DIM (by compareKey, so ties are broken by the whole key) is selected
+     * with nth_element and becomes the root, the two halves are built recursively
+     * While parallelDepth > 0, the left half is built as a separate task
+     * The node of the pair at base[i] is constructed at slotOf(i), so that tasks never share
+     * an allocation
+     * Time Complexity: O(n log n), the range is reordered
+     * @tparam DIM current dimension of node
+     * @param first
+     * @param last
+     * @param parent
+     * @param base beginning of the whole range being built
+     * @param slotOf storage of the node of each pair of the whole range, by index
+     * @param parallelDepth number of levels that may still fork a task
+     * @return the root of the subtree
+     */
+    template<size_t DIM, typename SlotOf>
+    Node* kdtree_build(Entry* first, Entry* last, Node* parent, Entry* base, const SlotOf& slotOf, size_t parallelDepth) {
         constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
-        if (v.empty()) {
+        constexpr ptrdiff_t PARALLEL_GRAIN = 1 << 15; // smaller subtrees are not worth a task
+        if (first == last) {
             return nullptr;
         }
-        std::stable_sort(v.begin(), v.end(), compareData<DIM>);
-        Node* node = new Node(v[v.size() / 2].first, v[v.size() / 2].second, parent);
-        node->left = kdtree_build<DIM_NEXT>(
-            std::vector<std::pair<Key, Value>>(v.begin(), v.begin() + v.size() / 2),
-            node
-        );
-        node->right = kdtree_build<DIM_NEXT>(
-            std::vector<std::pair<Key, Value>>(v.begin() + v.size() / 2 + 1, v.end()),
-            node
-        );
+        Entry* median = first + (last - first) / 2;
+        std::nth_element(first, median, last, compareData<DIM>);
+        Node* node = NodePool::construct(slotOf(static_cast<size_t>(median - base)), median->first, median->second, parent);
+        if (parallelDepth > 0 && last - first >= PARALLEL_GRAIN) {
+            auto left = std::async(std::launch::async, [=]() {
+                return kdtree_build<DIM_NEXT>(first, median, node, base, slotOf, parallelDepth - 1);
+            });
+            node->right = kdtree_build<DIM_NEXT>(median + 1, last, node, base, slotOf, parallelDepth - 1);
+            node->left = left.get();
+        } else {
+            node->left = kdtree_build<DIM_NEXT>(first, median, node, base, slotOf, 0);
+            node->right = kdtree_build<DIM_NEXT>(median + 1, last, node, base, slotOf, 0);
+        }
+        pull(node);
         return node;
     }
 
-    Node* kdtree_copy(Node* node, Node* parent) {
-        if (!node) {
-            return nullptr;
+    /**
+     * Dispatch kdtree_build to the template dimension dim
+     */
+    template<size_t DIM, typename SlotOf>
+    Node* buildDynamic(size_t dim, Entry* first, Entry* last, Node* parent, const SlotOf& slotOf) {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (dim == DIM) {
+            return kdtree_build<DIM>(first, last, parent, first, slotOf, buildParallelDepth());
         }
-        Node* newNode = new Node(node->key(), node->value(), parent);
-        newNode->left = kdtree_copy(node->left, newNode);
-        newNode->right = kdtree_copy(node->right, newNode);
-        return newNode;
+        return buildDynamic<DIM_NEXT>(dim, first, last, parent, slotOf);
     }
 
-    void clear(Node* node) {
-        if (!node) {
-            return;
+    /**
+     * @return whether a child of node holds more than balanceFactor of its subtree
+     */
+    bool isUnbalanced(Node* node) const {
+        if (balanceFactor <= 0) {
+            return false;
         }
-        clear(node->left);
-        clear(node->right);
-        delete node;
-    }
-
-    template<size_t DIM, typename Compare>
-    static bool my_compareKey(const Key& a, const Key& b, Compare compare = Compare()) {
-        return compare(std::get<DIM>(a), std::get<DIM>(b));
+        size_t heavier = std::max(node->left ? node->left->count : 0, node->right ? node->right->count : 0);
+        return static_cast<double>(heavier) > balanceFactor * static_cast<double>(node->count);
     }
 
-public:
-    KDTree() = default;
-
     /**
-     * Time complexity: O(kn log n)
-     * @param v we pass by value here because v need to be modified
+     * Rebuild a subtree into a perfectly balanced one with the median-split builder
+     * The new nodes reuse the storage of the live ones, dead nodes are freed
+     * Iterators into the subtree are invalidated
+     * Time Complexity: O(m log m), m is the size of the subtree
+     * @param node the link to the root of the subtree (root, or left / right of its parent)
+     * @param dim the dimension of that root
      */
-    explicit KDTree(std::vector<std::pair<Key, Value>> v) {
-        std::stable_sort(v.begin(), v.end(), compareData<0>);
-        auto it = std::unique(v.rbegin(), v.rend(), [](const Data& a, const Data& b) {
-            return a.first == b.first;
+    void rebuild(Node*& node, size_t dim) {
+        // read before the loop below destroys node
+        Node* parent = node->parent;
+        std::vector<Entry> entries;
+        std::vector<Slot*> slots;
+        entries.reserve(node->count);
+        slots.reserve(node->count);
+        std::vector<Node*> stack { node };
+        while (!stack.empty()) {
+            Node* current = stack.back();
+            stack.pop_back();
+            for (Node* child: { current->left, current->right }) {
+                if (child) {
+                    stack.push_back(child);
+                }
+            }
+            if (current->dead) {
+                pool.destroy(current);
+                --deadCount;
+                continue;
+            }
+            entries.emplace_back(current->key(), std::move(current->value()));
+            slots.push_back(reinterpret_cast<Slot*>(current));
+            current->~Node();
+        }
+        Entry* base = entries.data();
+        node = buildDynamic<0>(dim, base, base + entries.size(), parent, [&slots](size_t i) {
+            return slots[i];
         });
-        v.assign(it.base(), v.end());
-        root = kdtree_build<0>(v, nullptr);
-        treeSize = v.size();
     }
 
     /**
-     * Time complexity: O(n)
+     * Mark a live node dead and update the counts and boxes of its ancestors
+     * Time Complexity: O(k log n)
      */
-    KDTree(const KDTree& that) {
-        root = kdtree_copy(that.root, nullptr);
-        treeSize = that.treeSize;
+    void markDead(Node* node) {
+        node->dead = true;
+        --treeSize;
+        ++deadCount;
+        for (; node; node = node->parent) {
+            pull(node);
+        }
     }
 
     /**
-     * Time complexity: O(n)
+     * Compact the tree if the ratio of dead nodes exceeds tombstoneThreshold
+     * Time Complexity: O(n log n) if compacted, amortized O(log n / threshold)
+     * @return whether the tree was compacted
      */
-    KDTree& operator=(const KDTree& that) {
-        if (this == &that) {
-            return *this;
+    bool compactIfNeeded() {
+        if (tombstoneThreshold <= 0
+            || static_cast<double>(deadCount) <= tombstoneThreshold * static_cast<double>(treeSize + deadCount)) {
+            return false;
         }
-        clear(root);
-        root = kdtree_copy(that.root, nullptr);
-        treeSize = that.treeSize;
-        return *this;
+        compact();
+        return true;
     }
 
     /**
-     * Time complexity: O(n)
+     * Rebuild the whole tree if too many nodes were erased since the last rebuild
+     * Time Complexity: O(n log n) if rebuilt, amortized O(log n)
+     * @return whether the tree was rebuilt
      */
-    ~KDTree() {
-        clear(root);
+    bool rebalanceAfterErase() {
+        if (balanceFactor <= 0 || static_cast<double>(treeSize) >= balanceFactor * static_cast<double>(maxTreeSize)) {
+            return false;
+        }
+        if (root) {
+            rebuild(root, 0);
+        }
+        maxTreeSize = treeSize;
+        return true;
     }
 
-    Iterator begin() {
-        if (!root)
-            return end();
-        auto node = root;
-        while (node->left)
-            node = node->left;
-        return Iterator(this, node);
-    }
+    /**
+     * Layout of a snapshot record: right and end (uint64_t, the right subtree of record i is
+     * [right, end) and its left subtree is [i + 1, right)), count (uint64_t), dead (uint32_t),
+     * then the coordinates of the key, of lo and of hi, then the value
+     * Coordinates are copied one by one, so a record is plain bytes whatever the tuple layout
+     */
+    static constexpr size_t RECORD_RIGHT = 0, RECORD_END = 8, RECORD_COUNT = 16, RECORD_DEAD = 24;
 
-    Iterator end() {
-        return Iterator(this, nullptr);
+    /**
+     * @param field index of coordinate DIM of the key (DIM), of lo (k + DIM) or of hi
+     * (2k + DIM), or 3k for the value
+     * @return byte offset of the field in a record, or the record size if field is 3k + 1
+     */
+    static constexpr size_t recordField(size_t field) {
+        constexpr size_t sizes[] = { sizeof(KeyTypes)..., sizeof(Value) };
+        constexpr size_t aligns[] = { alignof(KeyTypes)..., alignof(Value) };
+        size_t offset = RECORD_DEAD + sizeof(uint32_t), align = alignof(uint64_t);
+        for (size_t i = 0; i <= 3 * KeySize; i++) {
+            size_t type = i < 3 * KeySize ? i % KeySize : KeySize;
+            offset = (offset + aligns[type] - 1) / aligns[type] * aligns[type];
+            if (i == field) {
+                return offset;
+            }
+            offset += sizes[type];
+            align = std::max(align, aligns[type]);
+        }
+        return (offset + align - 1) / align * align;
     }
 
-    Iterator find(const Key& key) {
-        return Iterator(this, find<0>(key, root));
-    }
+    static constexpr size_t RECORD_SIZE = recordField(3 * KeySize + 1);
 
-    void insert(const Key& key, const Value& value) {
-        insert<0>(key, value, root, nullptr);
+    /**
+     * Copy a key into (SET = 0 key, 1 lo, 2 hi) of a record
+     */
+    template<size_t SET>
+    static void writeRecordKey(char* record, const Key& key) {
+        allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            std::memcpy(record + recordField(SET * KeySize + DIM), &std::get<DIM>(key), sizeof(std::get<DIM>(key)));
+            return true;
+        });
     }
 
-    template<size_t DIM>
-    Iterator findMin() {
-        return Iterator(this, findMin<DIM, 0>(root));
+    /**
+     * @return the key (SET = 0), lo (1) or hi (2) of a record
+     */
+    template<size_t SET>
+    static Key readRecordKey(const char* record) {
+        Key key;
+        allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            std::memcpy(&std::get<DIM>(key), record + recordField(SET * KeySize + DIM), sizeof(std::get<DIM>(key)));
+            return true;
+        });
+        return key;
     }
 
-    Iterator findMin(size_t dim) {
-        return Iterator(this, findMinDynamic<0>(dim));
+    template<typename T>
+    static T readRecordField(const char* record, size_t offset) {
+        T value;
+        std::memcpy(&value, record + offset, sizeof(T));
+        return value;
     }
 
-    template<size_t DIM>
-    Iterator findMax() {
-        return Iterator(this, findMax<DIM, 0>(root));
+    /**
+     * Write the records of the tree in pre-order
+     * Iterative, so that a degenerated tree (e.g. built by sorted insertions) can not overflow
+     * the stack: the nodes are listed in pre-order first, then subtree sizes are accumulated
+     * backwards, the children of record i being after i
+     * Time Complexity: O(n), dead nodes included
+     * @return the number of records written
+     */
+    static uint64_t writeRecords(const Node* root, char* records) {
+        std::vector<const Node*> order; // order[i] is the node of record i
+        std::vector<const Node*> stack;
+        if (root) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            const Node* node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (const Node* child: { node->right, node->left }) {
+                if (child) {
+                    stack.push_back(child);
+                }
+            }
+        }
+        std::vector<uint64_t> subtreeSize(order.size());
+        for (uint64_t index = order.size(); index-- > 0;) {
+            const Node* node = order[index];
+            uint64_t leftSize = node->left ? subtreeSize[index + 1] : 0;
+            uint64_t right = index + 1 + leftSize;
+            uint64_t rightSize = node->right ? subtreeSize[right] : 0;
+            subtreeSize[index] = 1 + leftSize + rightSize;
+            uint64_t end = right + rightSize;
+            uint64_t count = node->count;
+            uint32_t dead = node->dead;
+            char* record = records + index * RECORD_SIZE;
+            std::memcpy(record + RECORD_RIGHT, &right, sizeof(right));
+            std::memcpy(record + RECORD_END, &end, sizeof(end));
+            std::memcpy(record + RECORD_COUNT, &count, sizeof(count));
+            std::memcpy(record + RECORD_DEAD, &dead, sizeof(dead));
+            writeRecordKey<0>(record, node->key());
+            writeRecordKey<1>(record, node->lo);
+            writeRecordKey<2>(record, node->hi);
+            std::memcpy(record + recordField(3 * KeySize), &node->value(), sizeof(Value));
+        }
+        return order.size();
     }
 
-    Iterator findMax(size_t dim) {
-        return Iterator(this, findMaxDynamic<0>(dim));
+    /**
+     * Morton code of key, coordinates are scaled from the box [lo, hi] to 64 / k bits each and
+     * interleaved, so that keys close in space are likely close in code order
+     * Time Complexity: O(64)
+     */
+    static uint64_t mortonCode(const Key& key, const Key& lo, const Key& hi) {
+        constexpr size_t BITS = std::min<size_t>(64 / KeySize, 32);
+        constexpr double SCALE = static_cast<double>((uint64_t(1) << BITS) - 1);
+        uint64_t cells[KeySize];
+        allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            double extent = axisDiff<DIM>(hi, lo);
+            double t = extent > 0 ? axisDiff<DIM>(key, lo) / extent : 0;
+            cells[DIM] = static_cast<uint64_t>(std::min(std::max(t, 0.0), 1.0) * SCALE);
+            return true;
+        });
+        uint64_t code = 0;
+        for (size_t bit = BITS; bit-- > 0;) {
+            for (size_t dim = 0; dim < KeySize; dim++) {
+                code = (code << 1) | ((cells[dim] >> bit) & 1);
+            }
+        }
+        return code;
     }
 
-    bool erase(const Key& key) {
-        auto prevSize = treeSize;
-        erase<0>(root, key);
-        return prevSize > treeSize;
+    /**
+     * Answer one query of queryBatch
+     * Time Complexity: O(k log n)
+     */
+    const Data* answer(const Query& query) const {
+        Node* node;
+        switch (query.kind) {
+            case Query::MIN:
+                node = findMinDynamic<0>(query.dim);
+                break;
+            case Query::MAX:
+                node = findMaxDynamic<0>(query.dim);
+                break;
+            default:
+                node = find<0>(query.key, root);
+                if (node && node->dead) {
+                    node = nullptr;
+                }
+        }
+        return node ? &node->data : nullptr;
     }
 
-    Iterator erase(Iterator it) {
-        if (it == end())
-            return it;
-        auto node = it.node;
-        if (!it.node->left && !it.node->right) {
+    /**
+     * @param threads number of threads to keep busy, 0 for one per core
+     * @return the number of tree levels to build in parallel
+     */
+    static size_t buildParallelDepth(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        size_t depth = 0;
+        for (size_t tasks = 1; tasks < threads; tasks *= 2) {
+            ++depth;
+        }
+        return depth;
+    }
+
+    /**
+     * Copy a subtree in pre-order into consecutive nodes of block
+     * The copy is iterative, so that a degenerate tree does not overflow the stack
+     * Time Complexity: O(n)
+     * @param node
+     * @param parent
+     * @param block
+     * @param used number of nodes of block already used, updated
+     * @return the root of the copied subtree
+     */
+    Node* kdtree_copy(Node* node, Node* parent, Slot* block, size_t& used) {
+        Node* newRoot = nullptr;
+        std::vector<std::tuple<const Node*, Node*, Node**>> stack; // (node, parent, link to the copy)
+        stack.emplace_back(node, parent, &newRoot);
+        while (!stack.empty()) {
+            auto [source, newParent, link] = stack.back();
+            stack.pop_back();
+            if (!source) {
+                continue;
+            }
+            Node* newNode = NodePool::construct(block + used++, source->key(), source->value(), newParent);
+            newNode->lo = source->lo;
+            newNode->hi = source->hi;
+            newNode->count = source->count;
+            newNode->dead = source->dead;
+            *link = newNode;
+            stack.emplace_back(source->right, newNode, &newNode->right);
+            stack.emplace_back(source->left, newNode, &newNode->left);
+        }
+        return newRoot;
+    }
+
+    /**
+     * Copy the whole tree of that, all nodes are allocated in one block
+     * Time Complexity: O(n)
+     */
+    void copyFrom(const KDTree& that) {
+        treeSize = that.treeSize;
+        balanceFactor = that.balanceFactor;
+        maxTreeSize = that.maxTreeSize;
+        tombstoneThreshold = that.tombstoneThreshold;
+        deadCount = that.deadCount;
+        if (!that.root) {
+            root = nullptr;
+            return;
+        }
+        size_t used = 0;
+        root = kdtree_copy(that.root, nullptr, pool.allocate(that.treeSize + that.deadCount), used);
+    }
+
+    /**
+     * Destroy all nodes
+     * Time Complexity: O(number of chunks) if Data is trivially destructible, otherwise O(n)
+     */
+    void clear() {
+        if constexpr (!std::is_trivially_destructible<Data>::value) {
+            std::vector<Node*> stack;
+            if (root) {
+                stack.push_back(root);
+            }
+            while (!stack.empty()) {
+                Node* node = stack.back();
+                stack.pop_back();
+                for (Node* child: { node->left, node->right }) {
+                    if (child) {
+                        stack.push_back(child);
+                    }
+                }
+                node->~Node();
+            }
+        }
+        pool.release();
+        root = nullptr;
+        treeSize = 0;
+        maxTreeSize = 0;
+        deadCount = 0;
+    }
+
+    /**
+     * Signed difference of two keys on a dimension
+     * Time Complexity: O(1)
+     * @tparam DIM
+     * @param a
+     * @param b
+     * @return a - b on dimension DIM
+     */
+    template<size_t DIM>
+    static double axisDiff(const Key& a, const Key& b) {
+        return static_cast<double>(std::get<DIM>(a)) - static_cast<double>(std::get<DIM>(b));
+    }
+
+    /**
+     * Unfinalized distance between two keys, summed over dimensions DIM...KeySize-1
+     * Time Complexity: O(k)
+     * @tparam DIM first dimension
+     * @tparam Metric
+     * @param a
+     * @param b
+     * @return the metric distance before Metric::finalize
+     */
+    template<size_t DIM, typename Metric>
+    static double rawDistance(const Key& a, const Key& b) {
+        if constexpr (DIM + 1 == KeySize) {
+            return Metric::axis(axisDiff<DIM>(a, b));
+        } else {
+            return Metric::combine(Metric::axis(axisDiff<DIM>(a, b)), rawDistance<DIM + 1, Metric>(a, b));
+        }
+    }
+
+    typedef std::pair<double, Node*> Neighbor; // (unfinalized distance, node)
+
+    /**
+     * Collect the k nearest nodes of key in a bounded max-heap
+     * The child on the same side of the splitting plane is visited first, the other
+     * child only if the plane is closer than the current k-th nearest node
+     * Time Complexity: O(log n) on average, O(n) in the worst case
+     * @tparam DIM current dimension of node
+     * @tparam Metric
+     * @param key
+     * @param k
+     * @param node
+     * @param heap the k nearest nodes found so far, farthest on top
+     */
+    template<size_t DIM, typename Metric>
+    void nearest(const Key& key, size_t k, Node* node, std::priority_queue<Neighbor>& heap) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        if (!node || node->count == 0) {
+            return;
+        }
+        KDTREE_COUNT_VISIT();
+        if (!node->dead) {
+            double distance = rawDistance<0, Metric>(key, node->key());
+            if (heap.size() < k) {
+                heap.emplace(distance, node);
+            } else if (distance < heap.top().first) {
+                heap.pop();
+                heap.emplace(distance, node);
+            }
+        }
+        double diff = axisDiff<DIM>(key, node->key());
+        Node* nearChild = diff < 0 ? node->left : node->right;
+        Node* farChild = diff < 0 ? node->right : node->left;
+        nearest<DIM_NEXT, Metric>(key, k, nearChild, heap);
+        if (heap.size() < k || Metric::axis(diff) < heap.top().first) {
+            nearest<DIM_NEXT, Metric>(key, k, farChild, heap);
+        }
+    }
+
+    /**
+     * The nodes of nearest, from the nearest to the farthest
+     */
+    template<typename Metric>
+    std::vector<Node*> nearestNodes(const Key& key, size_t k) const {
+        std::vector<Node*> result;
+        if (k == 0) {
+            return result;
+        }
+        std::priority_queue<Neighbor> heap;
+        nearest<0, Metric>(key, k, root, heap);
+        while (!heap.empty()) {
+            result.push_back(heap.top().second);
+            heap.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * The nodes of nearestApprox, from the nearest to the farthest
+     */
+    template<typename Metric>
+    std::vector<Node*> nearestApproxNodes(const Key& key, size_t k, double eps, size_t maxVisited) const {
+        std::vector<Node*> result;
+        if (k == 0 || maxVisited == 0 || !root || root->count == 0) {
+            return result;
+        }
+        const double factor = Metric::axis(1 + eps);
+        std::priority_queue<Neighbor, std::vector<Neighbor>, std::greater<>> queue; // (bound, subtree)
+        std::priority_queue<Neighbor> heap;
+        queue.emplace(boxDistance<Metric, false>(key, root->lo, root->hi), root);
+        auto worthVisiting = [&](double bound) {
+            return heap.size() < k || bound * factor < heap.top().first;
+        };
+        size_t visited = 0;
+        while (!queue.empty() && visited < maxVisited) {
+            auto [bound, node] = queue.top();
+            queue.pop();
+            if (!worthVisiting(bound)) {
+                break;
+            }
+            // descend towards the nearer child, queueing the farther one
+            while (node && visited < maxVisited) {
+                KDTREE_COUNT_VISIT();
+                if (!node->dead) {
+                    double distance = rawDistance<0, Metric>(key, node->key());
+                    if (heap.size() < k) {
+                        heap.emplace(distance, node);
+                    } else if (distance < heap.top().first) {
+                        heap.pop();
+                        heap.emplace(distance, node);
+                    }
+                    ++visited;
+                }
+                Neighbor children[2] = { { 0, node->left }, { 0, node->right } };
+                for (auto& child: children) {
+                    if (child.second && child.second->count) {
+                        child.first = boxDistance<Metric, false>(key, child.second->lo, child.second->hi);
+                    }
+                    if (!child.second || child.second->count == 0 || !worthVisiting(child.first)) {
+                        child.second = nullptr;
+                    }
+                }
+                if (children[1].second && (!children[0].second || children[1].first < children[0].first)) {
+                    std::swap(children[0], children[1]);
+                }
+                if (children[1].second) {
+                    queue.push(children[1]);
+                }
+                node = children[0].second;
+            }
+        }
+        while (!heap.empty()) {
+            result.push_back(heap.top().second);
+            heap.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * Call f(std::integral_constant<size_t, DIM>()) for every dimension
+     * Time Complexity: O(k)
+     * @return whether f returned true for all dimensions (stops at the first false)
+     */
+    template<typename F, size_t... DIMS>
+    static bool allDims(F f, std::index_sequence<DIMS...>) {
+        return (f(std::integral_constant<size_t, DIMS>()) && ...);
+    }
+
+    template<typename F>
+    static bool allDims(F f) {
+        return allDims(f, std::make_index_sequence<KeySize>());
+    }
+
+    /**
+     * Expand the box [lo, hi] to cover the box [otherLo, otherHi]
+     * Time Complexity: O(k)
+     */
+    static void expandBox(Key& lo, Key& hi, const Key& otherLo, const Key& otherHi) {
+        allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            if (std::get<DIM>(otherLo) < std::get<DIM>(lo)) {
+                std::get<DIM>(lo) = std::get<DIM>(otherLo);
+            }
+            if (std::get<DIM>(hi) < std::get<DIM>(otherHi)) {
+                std::get<DIM>(hi) = std::get<DIM>(otherHi);
+            }
+            return true;
+        });
+    }
+
+    /**
+     * @return whether the box [innerLo, innerHi] lies in the box [lo, hi]
+     */
+    static bool boxInside(const Key& innerLo, const Key& innerHi, const Key& lo, const Key& hi) {
+        return allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            return !(std::get<DIM>(innerLo) < std::get<DIM>(lo))
+                   && !(std::get<DIM>(hi) < std::get<DIM>(innerHi));
+        });
+    }
+
+    /**
+     * @return whether the boxes [aLo, aHi] and [bLo, bHi] intersect
+     */
+    static bool boxIntersect(const Key& aLo, const Key& aHi, const Key& bLo, const Key& bHi) {
+        return allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            return !(std::get<DIM>(aHi) < std::get<DIM>(bLo))
+                   && !(std::get<DIM>(bHi) < std::get<DIM>(aLo));
+        });
+    }
+
+    /**
+     * Recompute the bounding box and the count of a node from its key and children
+     * Time Complexity: O(k)
+     * @param node
+     */
+    static void pull(Node* node) {
+        node->lo = node->hi = node->key();
+        node->count = node->dead ? 0 : 1;
+        for (Node* child: { node->left, node->right }) {
+            if (child && child->count) {
+                if (node->count == 0) {
+                    node->lo = child->lo;
+                    node->hi = child->hi;
+                } else {
+                    expandBox(node->lo, node->hi, child->lo, child->hi);
+                }
+                node->count += child->count;
+            }
+        }
+    }
+
+    /**
+     * Visit all nodes in a subtree
+     * Time Complexity: O(size of the subtree)
+     */
+    template<typename Visitor>
+    static void visitAll(Node* node, Visitor& visitor) {
+        if (!node || node->count == 0) {
+            return;
+        }
+        KDTREE_COUNT_VISIT();
+        if (!node->dead) {
+            visitor(node->data);
+        }
+        visitAll(node->left, visitor);
+        visitAll(node->right, visitor);
+    }
+
+    /**
+     * Visit all nodes with a key in the box [lo, hi] in a subtree
+     * Subtrees whose bounding box is outside [lo, hi] are skipped, and subtrees whose
+     * bounding box is inside [lo, hi] are visited without any further check
+     * Time Complexity: O(n^(1-1/k) + m), m is the number of visited nodes
+     */
+    template<typename Visitor>
+    static void range(const Key& lo, const Key& hi, Node* node, Visitor& visitor) {
+        if (!node || node->count == 0 || !boxIntersect(node->lo, node->hi, lo, hi)) {
+            return;
+        }
+        KDTREE_COUNT_VISIT();
+        if (boxInside(node->lo, node->hi, lo, hi)) {
+            visitAll(node, visitor);
+            return;
+        }
+        if (!node->dead && boxInside(node->key(), node->key(), lo, hi)) {
+            visitor(node->data);
+        }
+        range(lo, hi, node->left, visitor);
+        range(lo, hi, node->right, visitor);
+    }
+
+    /**
+     * Count the nodes with a key in the box [lo, hi] in a subtree
+     * Time Complexity: O(n^(1-1/k))
+     */
+    static size_t rangeCount(const Key& lo, const Key& hi, Node* node) {
+        if (!node || node->count == 0 || !boxIntersect(node->lo, node->hi, lo, hi)) {
+            return 0;
+        }
+        KDTREE_COUNT_VISIT();
+        if (boxInside(node->lo, node->hi, lo, hi)) {
+            return node->count;
+        }
+        return static_cast<size_t>(!node->dead && boxInside(node->key(), node->key(), lo, hi))
+               + rangeCount(lo, hi, node->left) + rangeCount(lo, hi, node->right);
+    }
+
+    /**
+     * Unfinalized distance from key to the nearest (or farthest) point of the box [lo, hi]
+     * Time Complexity: O(k)
+     * @tparam Metric
+     * @tparam FARTHEST
+     */
+    template<typename Metric, bool FARTHEST>
+    static double boxDistance(const Key& key, const Key& lo, const Key& hi) {
+        double distance = 0;
+        allDims([&](auto dim) {
+            constexpr size_t DIM = decltype(dim)::value;
+            double below = axisDiff<DIM>(key, lo), above = axisDiff<DIM>(hi, key);
+            double d = FARTHEST ? std::max(below, above) : std::max(0.0, -std::min(below, above));
+            distance = Metric::combine(distance, Metric::axis(d));
+            return true;
+        });
+        return distance;
+    }
+
+    /**
+     * Candidate nodes of a fixed-radius query, tested against the ball in batches
+     * Coordinates are gathered as doubles in SoA layout so that the distance kernel is a
+     * fixed-length loop over contiguous arrays, which the compiler vectorizes
+     */
+    struct RadiusBatch {
+        static constexpr size_t SIZE = 64;
+
+        double coords[KeySize][SIZE] = {}; // unused slots are evaluated too, keep them initialized
+        double distances[SIZE];
+        Node* nodes[SIZE];
+        size_t size = 0;
+
+        void push(Node* node) {
+            allDims([&](auto dim) {
+                constexpr size_t DIM = decltype(dim)::value;
+                coords[DIM][size] = static_cast<double>(std::get<DIM>(node->key()));
+                return true;
+            });
+            nodes[size++] = node;
+        }
+
+        /**
+         * Compute the unfinalized distances from key of all slots (unused slots included)
+         * Time Complexity: O(k SIZE)
+         */
+        template<typename Metric>
+        void evaluate(const Key& key) {
+            std::fill(distances, distances + SIZE, 0.0);
+            allDims([&](auto dim) {
+                constexpr size_t DIM = decltype(dim)::value;
+                const double center = static_cast<double>(std::get<DIM>(key));
+                const double* axis = coords[DIM];
+                for (size_t i = 0; i < SIZE; i++) {
+                    distances[i] = Metric::combine(distances[i], Metric::axis(axis[i] - center));
+                }
+                return true;
+            });
+        }
+    };
+
+    /**
+     * Visit (or count) all live nodes within the unfinalized distance radius of key in a subtree
+     * Subtrees whose bounding box is outside the ball are skipped, subtrees whose bounding box
+     * is inside the ball are taken without any distance check, the remaining nodes are tested
+     * in batches
+     * Time Complexity: O(n^(1-1/k) + m) for m nodes in the ball
+     * @return the number of nodes within the radius that were counted but not batched
+     */
+    template<typename Metric, bool COUNT_ONLY, typename Visitor>
+    static size_t withinRadius(const Key& key, double radius, Node* node, RadiusBatch& batch, Visitor& visitor) {
+        if (!node || node->count == 0 || boxDistance<Metric, false>(key, node->lo, node->hi) > radius) {
+            return 0;
+        }
+        KDTREE_COUNT_VISIT();
+        if (boxDistance<Metric, true>(key, node->lo, node->hi) <= radius) {
+            if constexpr (COUNT_ONLY) {
+                return node->count;
+            } else {
+                visitAll(node, visitor);
+                return 0;
+            }
+        }
+        if (!node->dead) {
+            batch.push(node);
+            if (batch.size == RadiusBatch::SIZE) {
+                flushRadius<Metric>(key, radius, batch, visitor);
+            }
+        }
+        return withinRadius<Metric, COUNT_ONLY>(key, radius, node->left, batch, visitor)
+               + withinRadius<Metric, COUNT_ONLY>(key, radius, node->right, batch, visitor);
+    }
+
+    /**
+     * Test the batched candidates against the ball and empty the batch
+     * Time Complexity: O(k RadiusBatch::SIZE)
+     */
+    template<typename Metric, typename Visitor>
+    static void flushRadius(const Key& key, double radius, RadiusBatch& batch, Visitor& visitor) {
+        batch.template evaluate<Metric>(key);
+        for (size_t i = 0; i < batch.size; i++) {
+            if (batch.distances[i] <= radius) {
+                visitor(batch.nodes[i]->data);
+            }
+        }
+        batch.size = 0;
+    }
+
+public:
+    KDTree() = default;
+
+    /**
+     * If a key appears several times, the last value is kept
+     * Time complexity: O(kn log n), the levels are built in parallel
+     * @param v we pass by value here because v need to be modified
+     * @param threads number of threads, 0 for one per core
+     */
+    explicit KDTree(std::vector<std::pair<Key, Value>> v, size_t threads = 0) {
+        std::stable_sort(v.begin(), v.end(), compareData<0>);
+        auto it = std::unique(v.rbegin(), v.rend(), [](const Entry& a, const Entry& b) {
+            return a.first == b.first;
+        });
+        v.erase(v.begin(), it.base());
+        Entry* base = v.data();
+        Slot* block = pool.allocate(v.size());
+        root = kdtree_build<0>(base, base + v.size(), nullptr, base, [block](size_t i) {
+            return block + i;
+        }, buildParallelDepth(threads));
+        treeSize = v.size();
+    }
+
+    /**
+     * Time complexity: O(n)
+     */
+    KDTree(const KDTree& that) {
+        copyFrom(that);
+    }
+
+    /**
+     * Time complexity: O(n)
+     */
+    KDTree& operator=(const KDTree& that) {
+        if (this == &that) {
+            return *this;
+        }
+        clear();
+        copyFrom(that);
+        return *this;
+    }
+
+    /**
+     * Time complexity: O(1) if Data is trivially destructible, otherwise O(n)
+     */
+    ~KDTree() {
+        clear();
+    }
+
+    Iterator begin() {
+        if (!root)
+            return end();
+        auto node = root;
+        while (node->left)
+            node = node->left;
+        Iterator it(this, node);
+        if (node->dead)
+            ++it;
+        return it;
+    }
+
+    Iterator end() {
+        return Iterator(this, nullptr);
+    }
+
+    Iterator find(const Key& key) {
+        Node* node = find<0>(key, root);
+        return Iterator(this, node && !node->dead ? node : nullptr);
+    }
+
+    ConstIterator begin() const {
+        if (!root)
+            return end();
+        auto node = root;
+        while (node->left)
+            node = node->left;
+        ConstIterator it = makeConstIterator(node);
+        if (node->dead)
+            ++it;
+        return it;
+    }
+
+    ConstIterator end() const {
+        return makeConstIterator(nullptr);
+    }
+
+    /**
+     * Time complexity: O(k log n)
+     * @return a read-only iterator of the key, or end() if not found
+     */
+    ConstIterator find(const Key& key) const {
+        Node* node = find<0>(key, root);
+        return makeConstIterator(node && !node->dead ? node : nullptr);
+    }
+
+    /**
+     * Time complexity: O(log n) amortized if rebalancing is enabled, O(n) in the worst case otherwise
+     */
+    void insert(const Key& key, const Value& value) {
+        scapegoat = nullptr;
+        insert<0>(key, value, root, nullptr);
+        maxTreeSize = std::max(maxTreeSize, treeSize);
+        if (scapegoat) {
+            rebuild(*scapegoat, scapegoatDim);
+            scapegoat = nullptr;
+        }
+    }
+
+    /**
+     * Enable scapegoat-style rebalancing: after an insertion, the highest node with a child
+     * holding more than alpha of its subtree is rebuilt with the median split, and the whole
+     * tree is rebuilt once erasures shrink it below alpha of its size at the last rebuild
+     * This keeps the depth O(log n) under any insertion order (e.g. sorted keys)
+     * A rebuild invalidates the iterators into the rebuilt subtree
+     * Time complexity: O(n log n), the tree is rebuilt once when enabled
+     * @param alpha in (0.5, 1), smaller is better balanced but rebuilds more often, 0 to disable
+     */
+    void setBalanceFactor(double alpha) {
+        if (alpha != 0 && !(alpha > 0.5 && alpha < 1)) {
+            throw std::range_error("balance factor must be 0 or in (0.5, 1)");
+        }
+        balanceFactor = alpha;
+        maxTreeSize = treeSize;
+        if (alpha > 0 && root) {
+            rebuild(root, 0);
+        }
+    }
+
+    double getBalanceFactor() const {
+        return balanceFactor;
+    }
+
+    template<size_t DIM>
+    Iterator findMin() {
+        return Iterator(this, findMin<DIM, 0>(root));
+    }
+
+    Iterator findMin(size_t dim) {
+        return Iterator(this, findMinDynamic<0>(dim));
+    }
+
+    template<size_t DIM>
+    Iterator findMax() {
+        return Iterator(this, findMax<DIM, 0>(root));
+    }
+
+    Iterator findMax(size_t dim) {
+        return Iterator(this, findMaxDynamic<0>(dim));
+    }
+
+    template<size_t DIM>
+    ConstIterator findMin() const {
+        return makeConstIterator(findMin<DIM, 0>(root));
+    }
+
+    ConstIterator findMin(size_t dim) const {
+        return makeConstIterator(findMinDynamic<0>(dim));
+    }
+
+    template<size_t DIM>
+    ConstIterator findMax() const {
+        return makeConstIterator(findMax<DIM, 0>(root));
+    }
+
+    ConstIterator findMax(size_t dim) const {
+        return makeConstIterator(findMaxDynamic<0>(dim));
+    }
+
+    bool erase(const Key& key) {
+        if (tombstoneThreshold > 0) {
+            Node* node = find<0>(key, root);
+            if (!node || node->dead) {
+                return false;
+            }
+            markDead(node);
+            compactIfNeeded();
+            return true;
+        }
+        auto prevSize = treeSize;
+        erase<0>(root, key);
+        if (prevSize == treeSize) {
+            return false;
+        }
+        rebalanceAfterErase();
+        return true;
+    }
+
+    Iterator erase(Iterator it) {
+        if (it == end())
+            return it;
+        if (tombstoneThreshold > 0) {
+            Node* node = it.node;
+            ++it;
+            markDead(node);
+            if (it.node) {
+                // the compaction moves the entries between nodes, follow the key of the result
+                Key next = it.node->key();
+                if (compactIfNeeded()) {
+                    it.node = find<0>(next, root);
+                }
+            } else {
+                compactIfNeeded();
+            }
+            return it;
+        }
+        auto node = it.node;
+        if (!it.node->left && !it.node->right) {
             it.node = it.node->parent;
         }
         size_t depth = 0;
-        auto temp = node->parent;
+        auto parent = node->parent;
+        auto temp = parent;
         while (temp) {
             temp = temp->parent;
             ++depth;
         }
         eraseDynamic<0>(node, depth % KeySize);
+        for (temp = parent; temp; temp = temp->parent) {
+            pull(temp);
+        }
+        if (balanceFactor > 0 && it.node) {
+            // the rebuild moves the entries between nodes, follow the key of the result
+            Key next = it.node->key();
+            if (rebalanceAfterErase()) {
+                it.node = find<0>(next, root);
+            }
+        } else {
+            rebalanceAfterErase();
+        }
         return it;
     }
 
+    /**
+     * Erase all keys in a batch, keys not in the tree are ignored
+     * In tombstone mode the nodes are marked dead, otherwise a large batch is marked and the
+     * survivors are rebuilt at once instead of erasing the nodes one by one
+     * Time complexity: O(m k log n) for m keys, plus O(n log n) if the tree is rebuilt
+     * @return the number of erased keys
+     */
+    size_t eraseBatch(const std::vector<Key>& keys) {
+        constexpr size_t REBUILD_RATIO = 4; // rebuild if the batch is larger than 1/4 of the tree
+        size_t erased = 0;
+        if (tombstoneThreshold <= 0 && keys.size() * REBUILD_RATIO < treeSize) {
+            for (auto& key: keys) {
+                erased += erase(key);
+            }
+            return erased;
+        }
+        for (auto& key: keys) {
+            Node* node = find<0>(key, root);
+            if (!node || node->dead) {
+                continue;
+            }
+            ++erased;
+            if (tombstoneThreshold > 0) {
+                markDead(node);
+            } else {
+                // counts and boxes are left stale, the rebuild drops every dead node
+                node->dead = true;
+                --treeSize;
+                ++deadCount;
+            }
+        }
+        if (tombstoneThreshold > 0) {
+            compactIfNeeded();
+        } else if (erased) {
+            compact();
+        }
+        return erased;
+    }
+
+    /**
+     * Enable tombstone mode: erase only marks the node dead (queries and iterators skip it),
+     * and the tree is compacted once the ratio of dead nodes exceeds the threshold
+     * Disabling it compacts the tree
+     * Time complexity: O(n log n) if compacted
+     * @param threshold in (0, 1], 0 to erase eagerly
+     */
+    void setTombstoneThreshold(double threshold) {
+        if (!(threshold >= 0 && threshold <= 1)) {
+            throw std::range_error("tombstone threshold must be in [0, 1]");
+        }
+        tombstoneThreshold = threshold;
+        if (threshold == 0 && deadCount) {
+            compact();
+        } else {
+            compactIfNeeded();
+        }
+    }
+
+    double getTombstoneThreshold() const {
+        return tombstoneThreshold;
+    }
+
+    /**
+     * Rebuild the tree from its live nodes, freeing all dead nodes
+     * Iterators are invalidated
+     * Time complexity: O(n log n)
+     */
+    void compact() {
+        if (root) {
+            rebuild(root, 0);
+        }
+        maxTreeSize = treeSize;
+    }
+
+    /**
+     * @return the number of dead nodes waiting for a compaction
+     */
+    size_t deadSize() const {
+        return deadCount;
+    }
+
     size_t size() const {
         return treeSize;
     }
+
+    /**
+     * Visit all data with a key in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k) + m), m is the number of keys in the box
+     * @param lo
+     * @param hi
+     * @param visitor called with Data& of each key in the box, in no particular order
+     */
+    template<typename Visitor>
+    void range(const Key& lo, const Key& hi, Visitor visitor) {
+        range(lo, hi, root, visitor);
+    }
+
+    /**
+     * Time complexity: O(n^(1-1/k) + m), m is the number of keys in the box
+     * @param visitor called with const Data& of each key in the box, see range
+     */
+    template<typename Visitor>
+    void range(const Key& lo, const Key& hi, Visitor visitor) const {
+        auto constVisitor = [&visitor](Data& data) {
+            visitor(static_cast<const Data&>(data));
+        };
+        range(lo, hi, root, constVisitor);
+    }
+
+    /**
+     * Count the keys in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k))
+     */
+    size_t rangeCount(const Key& lo, const Key& hi) const {
+        return rangeCount(lo, hi, root);
+    }
+
+    /**
+     * Distance between two keys, all KeyTypes must be arithmetic
+     * Time complexity: O(k)
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    static double distance(const Key& a, const Key& b) {
+        return Metric::finalize(rawDistance<0, Metric>(a, b));
+    }
+
+    /**
+     * Find the k nearest neighbors of key, all KeyTypes must be arithmetic
+     * Time complexity: O(k log n) on average, O(n) in the worst case
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @param key
+     * @param k
+     * @return iterators of the (at most) k nearest nodes, from the nearest to the farthest
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<Iterator> nearest(const Key& key, size_t k) {
+        std::vector<Iterator> result;
+        for (Node* node: nearestNodes<Metric>(key, k)) {
+            result.push_back(Iterator(this, node));
+        }
+        return result;
+    }
+
+    /**
+     * Time complexity: O(k log n) on average, O(n) in the worst case
+     * @return read-only iterators of the (at most) k nearest nodes, see nearest
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<ConstIterator> nearest(const Key& key, size_t k) const {
+        std::vector<ConstIterator> result;
+        for (Node* node: nearestNodes<Metric>(key, k)) {
+            result.push_back(makeConstIterator(node));
+        }
+        return result;
+    }
+
+    /**
+     * Measure the depth and balance of all nodes, to detect a degenerated tree
+     * Time complexity: O(n)
+     */
+    KDTreeShape shapeStats() const {
+        constexpr size_t NONE = SIZE_MAX;
+        KDTreeShape shape;
+        double depthSum = 0;
+        // nodes in pre-order as (node, depth, position of the parent), so children come after their parent
+        std::vector<std::tuple<const Node*, size_t, size_t>> order;
+        std::vector<size_t> stack;
+        if (root) {
+            order.emplace_back(root, 0, NONE);
+            stack.push_back(0);
+        }
+        while (!stack.empty()) {
+            size_t position = stack.back();
+            stack.pop_back();
+            auto [node, depth, parent] = order[position];
+            depthSum += static_cast<double>(depth);
+            shape.maxDepth = std::max(shape.maxDepth, depth);
+            if (shape.depthHistogram.size() <= depth) {
+                shape.depthHistogram.resize(depth + 1);
+            }
+            ++shape.depthHistogram[depth];
+            for (const Node* child: { node->left, node->right }) {
+                if (child) {
+                    stack.push_back(order.size());
+                    order.emplace_back(child, depth + 1, position);
+                }
+            }
+        }
+        shape.nodes = order.size();
+        shape.averageDepth = shape.nodes ? depthSum / static_cast<double>(shape.nodes) : 0;
+        // subtree sizes (dead nodes included) and the size of the larger child, bottom-up
+        std::vector<size_t> sizes(order.size(), 1), largerChild(order.size(), 0);
+        for (size_t i = order.size(); i-- > 0;) {
+            size_t below = sizes[i] - 1;
+            if (below >= 2) {
+                ++shape.balanceHistogram[std::min<size_t>(largerChild[i] * 10 / below, 9)];
+            }
+            size_t parent = std::get<2>(order[i]);
+            if (parent != NONE) {
+                sizes[parent] += sizes[i];
+                largerChild[parent] = std::max(largerChild[parent], sizes[i]);
+            }
+        }
+        return shape;
+    }
+
+    /**
+     * Write a snapshot of the tree to path, which MappedKDTree serves without rebuilding
+     * Only for trivially copyable KeyTypes and Value, the image is only readable by builds
+     * with the same type sizes and byte order
+     * Time complexity: O(n)
+     * @throw std::runtime_error if the file can not be written
+     */
+    void save(const std::string& path) const {
+        static_assert(
+            (std::is_trivially_copyable<KeyTypes>::value && ...) && std::is_trivially_copyable<Value>::value,
+            "only trivially copyable keys and values can be saved"
+        );
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("can not open " + path);
+        }
+        KDTreeSnapshotHeader header {};
+        std::memcpy(header.magic, KDTreeSnapshotHeader::MAGIC, sizeof(header.magic));
+        header.keySize = sizeof(Key);
+        header.valueSize = sizeof(Value);
+        header.dimensions = KeySize;
+        header.recordSize = RECORD_SIZE;
+        header.treeSize = treeSize;
+        header.nodeCount = treeSize + deadCount;
+        header.recordOffset = (sizeof(header) + 63) / 64 * 64;
+        std::vector<char> records(header.nodeCount * RECORD_SIZE, 0);
+        writeRecords(root, records.data());
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        const char padding[64] = {};
+        out.write(padding, static_cast<std::streamsize>(header.recordOffset - sizeof(header)));
+        out.write(records.data(), static_cast<std::streamsize>(records.size()));
+        if (!out) {
+            throw std::runtime_error("can not write " + path);
+        }
+    }
+
+    /**
+     * Find approximate k nearest neighbors of key, all KeyTypes must be arithmetic
+     * Subtrees are visited best-bin-first (in order of the distance to their bounding box), and
+     * the search stops once no unvisited subtree can hold a point closer than the k-th nearest
+     * found divided by 1 + eps, or after maxVisited nodes. Every returned point is then within
+     * (1 + eps) times the distance of the true neighbor of its rank, unless the budget ran out
+     * With eps = 0 and no budget the result is exact
+     * Time complexity: O(min(maxVisited, n) log n)
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @param key
+     * @param k
+     * @param eps approximation factor, larger prunes more
+     * @param maxVisited maximum number of nodes whose distance is evaluated
+     * @return iterators of the (at most) k nearest nodes found, from the nearest to the farthest
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<Iterator> nearestApprox(const Key& key, size_t k, double eps, size_t maxVisited = SIZE_MAX) {
+        std::vector<Iterator> result;
+        for (Node* node: nearestApproxNodes<Metric>(key, k, eps, maxVisited)) {
+            result.push_back(Iterator(this, node));
+        }
+        return result;
+    }
+
+    /**
+     * Time complexity: O(min(maxVisited, n) log n)
+     * @return read-only iterators of the (at most) k nearest nodes found, see nearestApprox
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    std::vector<ConstIterator>
+    nearestApprox(const Key& key, size_t k, double eps, size_t maxVisited = SIZE_MAX) const {
+        std::vector<ConstIterator> result;
+        for (Node* node: nearestApproxNodes<Metric>(key, k, eps, maxVisited)) {
+            result.push_back(makeConstIterator(node));
+        }
+        return result;
+    }
+
+    /**
+     * Recall of an approximate neighbor list, i.e. the fraction of the exact neighbors found
+     * Time complexity: O(k^2)
+     * @return 1 if exact is empty
+     */
+    template<typename It>
+    static double recall(const std::vector<It>& approx, const std::vector<It>& exact) {
+        if (exact.empty()) {
+            return 1;
+        }
+        size_t found = 0;
+        for (auto& it: exact) {
+            found += std::find(approx.begin(), approx.end(), it) != approx.end();
+        }
+        return static_cast<double>(found) / static_cast<double>(exact.size());
+    }
+
+    /**
+     * Answer a batch of read-only queries on several threads
+     * Queries are reordered (MIN / MAX by dimension first, then FIND along a Morton curve when
+     * all KeyTypes are arithmetic) so that consecutive queries share the upper levels of the
+     * tree, and the reordered batch is split evenly between threads. A thread that finishes
+     * its share steals small chunks from the others
+     * Only const members are used, so several batches may run at the same time, but not
+     * together with any modification of the tree
+     * Time complexity: O(m log m + m k log n / threads) for m queries
+     * @param queries
+     * @param count number of queries
+     * @param threads number of threads, 0 for one per core
+     * @return for each query (in the given order), the found data, or nullptr if the key is
+     * not in the tree or the tree is empty
+     */
+    std::vector<const Data*> queryBatch(const Query* queries, size_t count, size_t threads = 0) const {
+        constexpr size_t GRAIN = 256; // queries taken from a share at a time
+        std::vector<const Data*> results(count, nullptr);
+        if (count == 0 || !root || root->count == 0) {
+            return results;
+        }
+        std::vector<std::pair<uint64_t, size_t>> order(count); // (sort key, query index)
+        for (size_t i = 0; i < count; i++) {
+            const Query& query = queries[i];
+            uint64_t sortKey = 3 * KeySize; // FIND queries come after all MIN / MAX groups
+            if (query.kind != Query::FIND) {
+                // before all FIND queries, grouped by kind and dimension
+                sortKey = query.kind * KeySize + query.dim % KeySize;
+            } else if constexpr ((std::is_arithmetic<KeyTypes>::value && ...)) {
+                sortKey = std::max<uint64_t>(mortonCode(query.key, root->lo, root->hi), 3 * KeySize);
+            }
+            order[i] = { sortKey, i };
+        }
+        std::sort(order.begin(), order.end());
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = std::min(threads, (count + GRAIN - 1) / GRAIN);
+        // each thread owns [next, end) of the reordered queries, other threads may steal from it
+        std::vector<std::atomic<size_t>> next(threads);
+        std::vector<size_t> end(threads);
+        for (size_t t = 0; t < threads; t++) {
+            next[t] = t * count / threads;
+            end[t] = (t + 1) * count / threads;
+        }
+        auto work = [&](size_t self) {
+            for (size_t victim = self, tried = 0; tried < threads; victim = (victim + 1) % threads, tried++) {
+                for (size_t begin; (begin = next[victim].fetch_add(GRAIN)) < end[victim];) {
+                    for (size_t i = begin; i < std::min(begin + GRAIN, end[victim]); i++) {
+                        results[order[i].second] = answer(queries[order[i].second]);
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++) {
+            workers.emplace_back(work, t);
+        }
+        work(0);
+        for (auto& worker: workers) {
+            worker.join();
+        }
+        return results;
+    }
+
+    std::vector<const Data*> queryBatch(const std::vector<Query>& queries, size_t threads = 0) const {
+        return queryBatch(queries.data(), queries.size(), threads);
+    }
+
+    /**
+     * Visit all data whose key is within distance r of key (bounds included), all KeyTypes
+     * must be arithmetic
+     * Time complexity: O(n^(1-1/k) + m), m is the number of visited nodes
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @param r nothing is visited if r is negative (or NaN)
+     * @param visitor called with Data& of each key in the ball, in no particular order
+     */
+    template<typename Metric = KDTreeMetric::L2, typename Visitor>
+    void withinRadius(const Key& key, double r, Visitor visitor) {
+        // Metric::axis squares r or takes its absolute value, so it must be checked first
+        if (!(r >= 0)) {
+            return;
+        }
+        RadiusBatch batch;
+        withinRadius<Metric, false>(key, Metric::axis(r), root, batch, visitor);
+        flushRadius<Metric>(key, Metric::axis(r), batch, visitor);
+    }
+
+    /**
+     * Time complexity: O(n^(1-1/k) + m), m is the number of visited nodes
+     * @param visitor called with const Data& of each key in the ball, see withinRadius
+     */
+    template<typename Metric = KDTreeMetric::L2, typename Visitor>
+    void withinRadius(const Key& key, double r, Visitor visitor) const {
+        auto constVisitor = [&visitor](Data& data) {
+            visitor(static_cast<const Data&>(data));
+        };
+        if (!(r >= 0)) {
+            return;
+        }
+        RadiusBatch batch;
+        withinRadius<Metric, false>(key, Metric::axis(r), root, batch, constVisitor);
+        flushRadius<Metric>(key, Metric::axis(r), batch, constVisitor);
+    }
+
+    /**
+     * Count the keys within distance r of key (bounds included), all KeyTypes must be arithmetic
+     * Time complexity: O(n^(1-1/k)), subtrees inside the ball are counted in O(1)
+     * @tparam Metric KDTreeMetric::L2, L1 or LInf
+     * @return 0 if r is negative (or NaN)
+     */
+    template<typename Metric = KDTreeMetric::L2>
+    size_t countWithinRadius(const Key& key, double r) const {
+        if (!(r >= 0)) {
+            return 0;
+        }
+        RadiusBatch batch;
+        size_t count = 0;
+        auto counter = [&count](Data&) {
+            ++count;
+        };
+        size_t inside = withinRadius<Metric, true>(key, Metric::axis(r), root, batch, counter);
+        flushRadius<Metric>(key, Metric::axis(r), batch, counter);
+        return inside + count;
+    }
 };
@@ -0,0 +1,995 @@
+// Behaviour tests of KDTree against a brute-force model, exits with a non-zero status if any
+// check fails
+// build: g++ -std=c++17 -O2 -pthread -o kdtree_test kdtree_test.cpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "implicit_kdtree.hpp"
+#include "kdtree.hpp"
+#include "mapped_kdtree.hpp"
+
+static size_t g_failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition     \
+                      << std::endl;                                                       \
+            ++g_failures;                                                                 \
+        }                                                                                 \
+    } while (false)
+
+typedef std::tuple<int, int> Point;
+typedef KDTree<Point, int> Tree;
+typedef std::map<Point, int> Model;
+
+/**
+ * @return whether the tree holds exactly the pairs of the model, by iteration and by find
+ */
+bool sameContents(Tree& tree, const Model& model) {
+    if (tree.size() != model.size()) {
+        return false;
+    }
+    size_t iterated = 0;
+    for (auto& [key, value]: tree) {
+        auto it = model.find(key);
+        if (it == model.end() || it->second != value) {
+            return false;
+        }
+        ++iterated;
+    }
+    for (auto& [key, value]: model) {
+        auto it = tree.find(key);
+        if (it == tree.end() || it->second != value) {
+            return false;
+        }
+    }
+    return iterated == model.size();
+}
+
+/**
+ * A KDTree with access to its nodes, to check the invariants of the subtrees
+ */
+class Inspector: public Tree {
+public:
+    using Tree::Tree;
+
+    /**
+     * @return whether the parent link, the live count and the bounding box of every subtree
+     * match its nodes
+     */
+    bool consistent() const {
+        size_t count;
+        Point lo, hi;
+        return consistent(root, nullptr, count, lo, hi) && count == treeSize;
+    }
+
+private:
+    static bool
+    consistent(const Node* node, const Node* parent, size_t& count, Point& lo, Point& hi) {
+        count = 0;
+        if (!node) {
+            return true;
+        }
+        if (node->parent != parent) {
+            return false;
+        }
+        if (!node->dead) {
+            count = 1;
+            lo = hi = node->key();
+        }
+        for (const Node* child: { node->left, node->right }) {
+            size_t childCount;
+            Point childLo, childHi;
+            if (!consistent(child, node, childCount, childLo, childHi)) {
+                return false;
+            }
+            if (childCount == 0) {
+                continue;
+            }
+            if (count == 0) {
+                lo = childLo;
+                hi = childHi;
+            } else {
+                lo = Point(
+                    std::min(std::get<0>(lo), std::get<0>(childLo)),
+                    std::min(std::get<1>(lo), std::get<1>(childLo))
+                );
+                hi = Point(
+                    std::max(std::get<0>(hi), std::get<0>(childHi)),
+                    std::max(std::get<1>(hi), std::get<1>(childHi))
+                );
+            }
+            count += childCount;
+        }
+        return node->count == count && (count == 0 || (node->lo == lo && node->hi == hi));
+    }
+};
+
+void testRebalance() {
+    constexpr size_t N = 1 << 14;
+    Tree tree;
+    tree.setBalanceFactor(0.7);
+    Model model;
+    // sorted insertion builds a path without rebalancing
+    for (int i = 0; i < static_cast<int>(N); i++) {
+        tree.insert(Point(i, i), i);
+        model[Point(i, i)] = i;
+    }
+    CHECK(sameContents(tree, model));
+    // an alpha-weight-balanced tree has depth at most log_{1/alpha} n
+    double depthBound = std::log(static_cast<double>(N)) / std::log(1 / 0.7) + 1;
+    CHECK(static_cast<double>(tree.shapeStats().maxDepth) <= depthBound);
+
+    // erasing most keys rebuilds the whole tree, also through the iterator overload
+    std::mt19937 random(2810);
+    for (int i = 0; i < static_cast<int>(N); i += 2) {
+        CHECK(tree.erase(Point(i, i)));
+        model.erase(Point(i, i));
+    }
+    for (auto it = tree.begin(); it != tree.end();) {
+        if (random() % 2) {
+            model.erase(it->first);
+            it = tree.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    CHECK(sameContents(tree, model));
+    CHECK(static_cast<double>(tree.shapeStats().maxDepth) <= depthBound);
+
+    // enabling rebalancing on a degenerated tree rebuilds it at once
+    Tree path;
+    for (int i = 0; i < 1000; i++) {
+        path.insert(Point(i, -i), i);
+    }
+    CHECK(path.shapeStats().maxDepth == 999);
+    path.setBalanceFactor(0.6);
+    CHECK(path.shapeStats().maxDepth < 20);
+    CHECK(path.size() == 1000 && path.find(Point(500, -500))->second == 500);
+}
+
+/**
+ * @return whether findMin / findMax on every dimension return the model's extreme keys,
+ * ordered by the coordinate, then by the whole key
+ */
+bool sameExtremes(Tree& tree, const Model& model) {
+    for (size_t dim = 0; dim < 2; dim++) {
+        auto coordinate = [dim](const Point& p) {
+            return dim == 0 ? std::get<0>(p) : std::get<1>(p);
+        };
+        auto less = [&](const Point& a, const Point& b) {
+            return std::make_pair(coordinate(a), a) < std::make_pair(coordinate(b), b);
+        };
+        auto min = tree.findMin(dim), max = tree.findMax(dim);
+        if (model.empty()) {
+            if (min != tree.end() || max != tree.end()) {
+                return false;
+            }
+            continue;
+        }
+        Point minKey = model.begin()->first, maxKey = minKey;
+        for (auto& [key, value]: model) {
+            minKey = less(key, minKey) ? key : minKey;
+            maxKey = less(maxKey, key) ? key : maxKey;
+        }
+        if (min == tree.end() || min->first != minKey || max == tree.end()
+            || max->first != maxKey)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void testTombstones() {
+    // a dead root must not hide the right subtree from findMin on its splitting dimension
+    Tree small;
+    small.setTombstoneThreshold(0.9);
+    small.insert(Point(1, 1), 1);
+    small.insert(Point(2, 2), 2);
+    small.insert(Point(3, 0), 3);
+    small.erase(Point(1, 1));
+    CHECK(small.size() == 2 && small.deadSize() == 1);
+    CHECK(small.findMin<0>() != small.end() && small.findMin<0>()->first == Point(2, 2));
+    CHECK(small.findMin<1>() != small.end() && small.findMin<1>()->first == Point(3, 0));
+    CHECK(small.findMax<0>()->first == Point(3, 0));
+
+    std::mt19937 random(2810);
+    for (double threshold: { 0.0, 0.2, 0.5, 0.9, 1.0 }) {
+        for (size_t seed = 0; seed < 100; seed++) {
+            Tree tree;
+            tree.setTombstoneThreshold(threshold);
+            if (seed % 2) {
+                tree.setBalanceFactor(0.7);
+            }
+            Model model;
+            // few distinct coordinates, so that many keys tie on the compared dimension
+            auto randomPoint = [&]() {
+                return Point(static_cast<int>(random() % 8), static_cast<int>(random() % 8));
+            };
+            bool ok = true;
+            for (size_t step = 0; step < 80 && ok; step++) {
+                Point key = randomPoint();
+                switch (random() % 4) {
+                    case 0:
+                    case 1:
+                        tree.insert(key, static_cast<int>(step));
+                        model[key] = static_cast<int>(step);
+                        break;
+                    case 2:
+                        ok = tree.erase(key) == (model.erase(key) == 1);
+                        break;
+                    default: {
+                        std::vector<Point> keys { key, randomPoint(), randomPoint() };
+                        size_t erased = 0;
+                        for (auto& k: keys) {
+                            erased += model.erase(k);
+                        }
+                        ok = tree.eraseBatch(keys) == erased;
+                    }
+                }
+                ok = ok && sameContents(tree, model) && sameExtremes(tree, model);
+            }
+            CHECK(ok);
+        }
+    }
+}
+
+/**
+ * Random points with few distinct coordinates, so that queries hit boundaries and ties
+ */
+std::vector<std::pair<Point, int>> randomPoints(size_t n, int spread, std::mt19937& random) {
+    std::vector<std::pair<Point, int>> points(n);
+    for (size_t i = 0; i < n; i++) {
+        int x = static_cast<int>(random() % (2 * spread + 1)) - spread;
+        int y = static_cast<int>(random() % (2 * spread + 1)) - spread;
+        points[i] = { Point(x, y), static_cast<int>(i) };
+    }
+    return points;
+}
+
+void testBuild() {
+    std::mt19937 random(2810);
+    // enough distinct keys for the bulk build to fork on two levels (the parallel grain is
+    // 1 << 15), and many duplicates
+    auto points = randomPoints(1 << 17, 300, random);
+    Model model;
+    for (auto& [key, value]: points) {
+        model[key] = value;
+    }
+    CHECK(model.size() < points.size());
+    for (size_t threads: { 1, 2, 3, 8 }) {
+        Inspector tree(points, threads);
+        CHECK(tree.consistent());
+        CHECK(sameContents(tree, model));
+    }
+    Inspector tree(points);
+    CHECK(tree.consistent() && sameContents(tree, model));
+    Inspector empty(std::vector<std::pair<Point, int>>(), 4);
+    CHECK(empty.consistent() && empty.size() == 0 && empty.begin() == empty.end());
+}
+
+void testCopy() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(3000, 40, random);
+    Inspector tree(points);
+    tree.setTombstoneThreshold(0.9);
+    Model model;
+    for (auto& [key, value]: points) {
+        model[key] = value;
+    }
+    for (size_t i = 0; i < points.size(); i += 3) {
+        tree.erase(points[i].first);
+        model.erase(points[i].first);
+    }
+    CHECK(tree.deadSize() > 0);
+
+    Inspector copy(tree), assigned;
+    assigned.insert(Point(1000, 1000), 1);
+    assigned = tree;
+    Inspector& alias = tree;
+    tree = alias;
+    CHECK(tree.consistent() && sameContents(tree, model));
+    for (Inspector* other: { &copy, &assigned }) {
+        CHECK(other->consistent() && sameContents(*other, model));
+        CHECK(other->deadSize() == tree.deadSize());
+    }
+
+    // the trees are independent, whichever is modified
+    Model changed = model;
+    for (size_t i = 0; i < 1000; i++) {
+        auto& [key, value] = points[random() % points.size()];
+        if (random() % 2) {
+            tree.erase(key);
+            changed.erase(key);
+        } else {
+            tree.insert(key, -value);
+            changed[key] = -value;
+        }
+    }
+    CHECK(tree.consistent() && sameContents(tree, changed));
+    CHECK(copy.consistent() && sameContents(copy, model));
+    assigned.insert(Point(1000, 1000), 1);
+    CHECK(sameContents(tree, changed) && sameContents(copy, model));
+
+    // slots freed by eager erasures are reused by insertions, in the copy as well
+    Inspector eager(points);
+    Model eagerModel;
+    for (auto& [key, value]: points) {
+        eagerModel[key] = value;
+    }
+    for (size_t round = 0; round < 3; round++) {
+        for (size_t i = round; i < points.size(); i += 4) {
+            eager.erase(points[i].first);
+            eagerModel.erase(points[i].first);
+        }
+        for (size_t i = round; i < points.size(); i += 5) {
+            eager.insert(points[i].first, static_cast<int>(round));
+            eagerModel[points[i].first] = static_cast<int>(round);
+        }
+        CHECK(eager.deadSize() == 0);
+        CHECK(eager.consistent() && sameContents(eager, eagerModel));
+        Inspector eagerCopy = eager;
+        CHECK(eagerCopy.consistent() && sameContents(eagerCopy, eagerModel));
+    }
+
+    // a path, as deep as it is large
+    Inspector path;
+    for (int i = 0; i < 10000; i++) {
+        path.insert(Point(i, i), i);
+    }
+    Inspector pathCopy = path;
+    CHECK(pathCopy.shapeStats().maxDepth == 9999);
+    CHECK(pathCopy.consistent() && pathCopy.size() == 10000);
+    CHECK(pathCopy.find(Point(9999, 9999))->second == 9999);
+    Inspector empty, emptyCopy(empty);
+    CHECK(emptyCopy.size() == 0 && emptyCopy.begin() == emptyCopy.end());
+}
+
+void checkRange(Tree& tree, const Model& model, const Point& lo, const Point& hi) {
+    auto inBox = [&](const Point& key) {
+        return std::get<0>(lo) <= std::get<0>(key) && std::get<0>(key) <= std::get<0>(hi)
+               && std::get<1>(lo) <= std::get<1>(key) && std::get<1>(key) <= std::get<1>(hi);
+    };
+    Model expected;
+    for (auto& [key, value]: model) {
+        if (inBox(key)) {
+            expected[key] = value;
+        }
+    }
+    Model visited;
+    tree.range(lo, hi, [&](Tree::Data& data) {
+        visited[data.first] = data.second;
+    });
+    CHECK(visited == expected);
+    CHECK(tree.rangeCount(lo, hi) == expected.size());
+}
+
+void testRange() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(2000, 50, random);
+    Tree tree(points);
+    Model model;
+    for (auto& [key, value]: points) {
+        model[key] = value;
+    }
+    auto randomBox = [&](Point& lo, Point& hi) {
+        int x0 = static_cast<int>(random() % 121) - 60, x1 = static_cast<int>(random() % 121) - 60;
+        int y0 = static_cast<int>(random() % 121) - 60, y1 = static_cast<int>(random() % 121) - 60;
+        lo = Point(std::min(x0, x1), std::min(y0, y1));
+        hi = Point(std::max(x0, x1), std::max(y0, y1));
+    };
+    Point lo, hi;
+    for (size_t i = 0; i < 100; i++) {
+        randomBox(lo, hi);
+        checkRange(tree, model, lo, hi);
+    }
+    // boxes and counts stay exact through inserts and erases of both kinds
+    for (double threshold: { 0.0, 0.5 }) {
+        tree.setTombstoneThreshold(threshold);
+        for (size_t i = 0; i < 500; i++) {
+            auto& [key, value] = points[random() % points.size()];
+            if (random() % 2) {
+                tree.erase(key);
+                model.erase(key);
+            } else {
+                tree.insert(key, value);
+                model[key] = value;
+            }
+            if (i % 50 == 0) {
+                randomBox(lo, hi);
+                checkRange(tree, model, lo, hi);
+            }
+        }
+    }
+    checkRange(tree, model, Point(-100, -100), Point(100, 100));
+    checkRange(tree, model, Point(5, 5), Point(4, 4));
+}
+
+template<typename Metric>
+void checkRadius(Tree& tree, const Model& model, const Point& center, double r) {
+    size_t expected = 0;
+    for (auto& [key, value]: model) {
+        expected += Tree::distance<Metric>(key, center) <= r;
+    }
+    size_t visited = 0;
+    bool inside = true;
+    tree.withinRadius<Metric>(center, r, [&](Tree::Data& data) {
+        inside = inside && Tree::distance<Metric>(data.first, center) <= r;
+        ++visited;
+    });
+    CHECK(inside && visited == expected);
+    CHECK(tree.countWithinRadius<Metric>(center, r) == expected);
+}
+
+void testRadius() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(2000, 50, random);
+    Tree tree(points);
+    Model model;
+    for (auto& [key, value]: points) {
+        model[key] = value;
+    }
+    CHECK(sameContents(tree, model));
+    for (size_t i = 0; i < 100; i++) {
+        Point center(static_cast<int>(random() % 121) - 60, static_cast<int>(random() % 121) - 60);
+        // integer radii land exactly on points, bounds are included
+        double r = static_cast<double>(random() % 40);
+        checkRadius<KDTreeMetric::L2>(tree, model, center, r);
+        checkRadius<KDTreeMetric::L1>(tree, model, center, r);
+        checkRadius<KDTreeMetric::LInf>(tree, model, center, r);
+    }
+    // the whole tree is inside a large ball, nothing is inside a negative one
+    checkRadius<KDTreeMetric::L2>(tree, model, Point(0, 0), 1000);
+    size_t visited = 0;
+    tree.withinRadius(Point(0, 0), -3, [&visited](Tree::Data&) {
+        ++visited;
+    });
+    CHECK(visited == 0);
+    CHECK(tree.countWithinRadius(Point(0, 0), -3) == 0);
+    CHECK(tree.countWithinRadius<KDTreeMetric::L1>(Point(0, 0), -3) == 0);
+    CHECK(tree.countWithinRadius(Point(0, 0), std::nan("")) == 0);
+    CHECK(tree.countWithinRadius(points[0].first, 0) >= 1);
+}
+
+template<typename Metric>
+void checkNearest(Tree& tree, const Model& model, const Point& key, size_t k) {
+    std::vector<double> expected;
+    for (auto& [point, value]: model) {
+        expected.push_back(Tree::distance<Metric>(point, key));
+    }
+    std::sort(expected.begin(), expected.end());
+    expected.resize(std::min(k, expected.size()));
+    auto result = tree.nearest<Metric>(key, k);
+    // ties may be broken either way, so the distances are compared, not the keys
+    bool same = result.size() == expected.size();
+    for (size_t i = 0; same && i < result.size(); i++) {
+        same = Tree::distance<Metric>(result[i]->first, key) == expected[i]
+               && model.at(result[i]->first) == result[i]->second;
+    }
+    CHECK(same);
+}
+
+void testNearest() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(1000, 30, random);
+    Tree tree;
+    Model model;
+    for (auto& [key, value]: points) {
+        tree.insert(key, value);
+        model[key] = value;
+    }
+    for (size_t i = 0; i < 100; i++) {
+        Point key(static_cast<int>(random() % 81) - 40, static_cast<int>(random() % 81) - 40);
+        for (size_t k: { 1, 5, 32 }) {
+            checkNearest<KDTreeMetric::L2>(tree, model, key, k);
+            checkNearest<KDTreeMetric::L1>(tree, model, key, k);
+            checkNearest<KDTreeMetric::LInf>(tree, model, key, k);
+        }
+    }
+    // dead nodes are never returned
+    tree.setTombstoneThreshold(0.9);
+    for (size_t i = 0; i < points.size(); i += 3) {
+        tree.erase(points[i].first);
+        model.erase(points[i].first);
+    }
+    CHECK(tree.deadSize() > 0);
+    for (size_t i = 0; i < 20; i++) {
+        Point key(static_cast<int>(random() % 81) - 40, static_cast<int>(random() % 81) - 40);
+        checkNearest<KDTreeMetric::L2>(tree, model, key, 8);
+    }
+    CHECK(tree.nearest(Point(0, 0), 0).empty());
+    checkNearest<KDTreeMetric::L2>(tree, model, Point(0, 0), model.size() + 10);
+    Tree empty;
+    CHECK(empty.nearest(Point(0, 0), 3).empty());
+}
+
+/**
+ * @return whether the j-th distance of approx is within 1 + eps times the exact j-th distance,
+ * for every rank j of approx
+ */
+bool withinFactor(const std::vector<double>& approx, const std::vector<double>& exact, double eps) {
+    if (approx.size() > exact.size()) {
+        return false;
+    }
+    for (size_t j = 0; j < approx.size(); j++) {
+        // a relative slack for the rounding of the square roots
+        if (approx[j] > exact[j] * (1 + eps) * (1 + 1e-12) || approx[j] < exact[j]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void testNearestApprox() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(3000, 1000, random);
+    Tree tree(points);
+    tree.setTombstoneThreshold(0.9);
+    for (size_t i = 0; i < points.size(); i += 4) {
+        tree.erase(points[i].first);
+    }
+    CHECK(tree.deadSize() > 0);
+    const Tree& reader = tree;
+    auto distances = [](const auto& iterators, const Point& key) {
+        std::vector<double> result;
+        for (auto& it: iterators) {
+            result.push_back(Tree::distance(it->first, key));
+        }
+        return result;
+    };
+    bool exact = true, bounded = true, capped = true;
+    for (size_t i = 0; i < 100; i++) {
+        Point key(
+            static_cast<int>(random() % 2400) - 1200, static_cast<int>(random() % 2400) - 1200
+        );
+        auto all = distances(reader.nearest(key, tree.size()), key);
+        for (size_t k: { 1, 10 }) {
+            auto expected = distances(reader.nearest(key, k), key);
+            exact = exact && distances(reader.nearestApprox(key, k, 0), key) == expected;
+            exact = exact && Tree::recall(tree.nearestApprox(key, k, 0), tree.nearest(key, k)) == 1;
+            for (double eps: { 0.1, 0.5, 2.0 }) {
+                auto approx = distances(reader.nearestApprox(key, k, eps), key);
+                bounded = bounded && withinFactor(approx, all, eps);
+            }
+        }
+        // the budget counts the live nodes whose distance is evaluated, each is a candidate
+        for (size_t budget: { 1, 3, 20 }) {
+            capped = capped && reader.nearestApprox(key, 50, 0, budget).size() == budget;
+        }
+    }
+    CHECK(exact && bounded && capped);
+    CHECK(tree.nearestApprox(Point(0, 0), 5, 0, 0).empty());
+    CHECK(Tree().nearestApprox(Point(0, 0), 5, 0).empty());
+    auto some = tree.nearest(Point(0, 0), 4);
+    CHECK(Tree::recall(some, {}) == 1 && Tree::recall({}, some) == 0);
+    CHECK(Tree::recall(std::vector<Tree::Iterator>(some.begin(), some.begin() + 1), some) == 0.25);
+}
+
+typedef ImplicitKDTree<Point, int> Implicit;
+
+/**
+ * @return whether find, range, rangeCount and nearest of the implicit tree agree with the model
+ * over keys and boxes in [-spread - 1, spread + 1]
+ */
+bool sameAsImplicit(const Implicit& tree, const Model& model, int spread, std::mt19937& random) {
+    if (tree.size() != model.size()) {
+        return false;
+    }
+    int width = 2 * spread + 3;
+    auto randomKey = [&]() {
+        return Point(
+            static_cast<int>(random() % width) - spread - 1,
+            static_cast<int>(random() % width) - spread - 1
+        );
+    };
+    for (auto& [key, value]: model) {
+        const int* found = tree.find(key);
+        if (!found || *found != value) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < 50; i++) {
+        Point key = randomKey();
+        if ((tree.find(key) != nullptr) != (model.count(key) == 1)) {
+            return false;
+        }
+        Point a = randomKey(), b = randomKey();
+        auto [ax, ay] = a;
+        auto [bx, by] = b;
+        Point lo(std::min(ax, bx), std::min(ay, by)), hi(std::max(ax, bx), std::max(ay, by));
+        Model expected, visited;
+        for (auto& [point, value]: model) {
+            if (std::get<0>(lo) <= std::get<0>(point) && std::get<0>(point) <= std::get<0>(hi)
+                && std::get<1>(lo) <= std::get<1>(point) && std::get<1>(point) <= std::get<1>(hi))
+            {
+                expected[point] = value;
+            }
+        }
+        size_t calls = 0;
+        tree.range(lo, hi, [&](const Point& point, const int& value) {
+            visited[point] = value;
+            ++calls;
+        });
+        if (visited != expected || calls != expected.size()
+            || tree.rangeCount(lo, hi) != expected.size())
+        {
+            return false;
+        }
+        std::vector<double> distances;
+        for (auto& [point, value]: model) {
+            distances.push_back(Tree::distance(point, key));
+        }
+        std::sort(distances.begin(), distances.end());
+        for (size_t k: { 1, 5, 40 }) {
+            auto result = tree.nearest(key, k);
+            if (result.size() != std::min(k, model.size())) {
+                return false;
+            }
+            for (size_t j = 0; j < result.size(); j++) {
+                if (result[j].distance != distances[j]
+                    || *result[j].value != model.at(result[j].key))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void testImplicit() {
+    std::mt19937 random(2810);
+    // no point, one point, around one leaf bucket (32 points) and many buckets, with duplicate
+    // keys and many coordinates equal to a split value
+    for (size_t n: { 0, 1, 31, 32, 33, 64, 3000 }) {
+        int spread = n < 100 ? 4 : 40;
+        std::vector<Point> cells;
+        for (int x = -spread; x <= spread; x++) {
+            for (int y = -spread; y <= spread; y++) {
+                cells.emplace_back(x, y);
+            }
+        }
+        std::shuffle(cells.begin(), cells.end(), random);
+        std::vector<std::pair<Point, int>> points;
+        for (size_t i = 0; i < n + n / 2; i++) {
+            points.emplace_back(cells[i < n ? i : random() % n], static_cast<int>(i));
+        }
+        std::shuffle(points.begin(), points.end(), random);
+        Model model;
+        for (auto& [key, value]: points) {
+            model[key] = value;
+        }
+        CHECK(model.size() == n);
+        for (uint64_t seed: { 0, 7 }) {
+            Implicit tree(points, seed);
+            CHECK(sameAsImplicit(tree, model, spread, random));
+        }
+        Tree source(points);
+        CHECK(sameAsImplicit(Implicit(source), model, spread, random));
+    }
+    Implicit empty;
+    CHECK(empty.size() == 0 && empty.find(Point(0, 0)) == nullptr);
+    CHECK(empty.rangeCount(Point(-1, -1), Point(1, 1)) == 0);
+    CHECK(empty.nearest(Point(0, 0), 3).empty());
+}
+
+void testForest() {
+    typedef KDForest<Point, int> Forest;
+    std::mt19937 random(2810);
+    auto points = randomPoints(3000, 1000, random);
+    points.push_back({ points[0].first, -1 });
+    Model model;
+    for (auto& [key, value]: points) {
+        model[key] = value;
+    }
+    Implicit single(points);
+    for (size_t trees: { 0, 1, 4 }) {
+        Forest forest(points, trees);
+        CHECK(forest.size() == model.size() && forest.treeCount() == std::max<size_t>(trees, 1));
+        bool exact = true, bounded = true, capped = true;
+        for (size_t i = 0; i < 100; i++) {
+            Point key(
+                static_cast<int>(random() % 2400) - 1200, static_cast<int>(random() % 2400) - 1200
+            );
+            std::vector<double> all;
+            for (auto& [point, value]: model) {
+                all.push_back(Tree::distance(point, key));
+            }
+            std::sort(all.begin(), all.end());
+            auto distances = [](const std::vector<Forest::Neighbor>& neighbors) {
+                std::vector<double> result;
+                for (auto& neighbor: neighbors) {
+                    result.push_back(neighbor.distance);
+                }
+                return result;
+            };
+            // with eps = 0 and no budget, the forest is exact, each point is found once
+            auto found = forest.nearest(key, 10);
+            exact = exact && distances(found) == std::vector<double>(all.begin(), all.begin() + 10);
+            Model keys;
+            for (auto& neighbor: found) {
+                exact = exact && *neighbor.value == model.at(neighbor.key);
+                keys[neighbor.key] = *neighbor.value;
+            }
+            exact = exact && keys.size() == found.size();
+            exact = exact && Implicit::recall(found, found) == 1;
+            for (double eps: { 0.5, 2.0 }) {
+                auto approx = distances(forest.nearest(key, 10, eps));
+                bounded = bounded && withinFactor(approx, all, eps);
+                approx = distances(single.nearest(key, 10, eps));
+                bounded = bounded && withinFactor(approx, all, eps);
+            }
+            // one leaf bucket holds at most LeafSize points
+            capped = capped && forest.nearest(key, 100, 0, 1).size() <= Implicit::LeafSize;
+            capped = capped && !forest.nearest(key, 100, 0, 3).empty();
+            capped = capped && single.nearest(key, 100, 0, 2).size() <= 2 * Implicit::LeafSize;
+        }
+        CHECK(exact && bounded && capped);
+        CHECK(forest.nearest(Point(0, 0), 0).empty());
+        CHECK(forest.nearest(Point(0, 0), 5, 0, 0).empty());
+    }
+    Forest empty({}, 3);
+    CHECK(empty.size() == 0 && empty.nearest(Point(0, 0), 5).empty());
+    CHECK(Implicit::recall({}, single.nearest(Point(0, 0), 3)) == 0);
+}
+
+void testConcurrentReads() {
+    std::mt19937 random(2810);
+    auto points = randomPoints(20000, 1000, random);
+    Tree tree(points);
+    for (size_t i = 0; i < points.size(); i += 5) {
+        tree.erase(points[i].first);
+    }
+    const Tree& reader = tree;
+    Model model;
+    for (auto& [key, value]: reader) {
+        model[key] = value;
+    }
+    CHECK(model.size() == reader.size());
+
+    // queryBatch answers like the sequential const lookups, for any number of threads
+    std::vector<Tree::Query> queries(5000);
+    for (size_t i = 0; i < queries.size(); i++) {
+        Tree::Query& query = queries[i];
+        query.kind = i % 10 == 0   ? Tree::Query::MIN
+                     : i % 10 == 1 ? Tree::Query::MAX
+                                   : Tree::Query::FIND;
+        query.key = points[random() % points.size()].first;
+        query.dim = random() % 3;
+    }
+    for (size_t threads: { 1, 2, 4 }) {
+        auto results = reader.queryBatch(queries, threads);
+        bool same = results.size() == queries.size();
+        for (size_t i = 0; same && i < queries.size(); i++) {
+            auto& query = queries[i];
+            Tree::ConstIterator expected = reader.end();
+            if (query.kind == Tree::Query::FIND) {
+                expected = reader.find(query.key);
+            } else if (query.kind == Tree::Query::MIN) {
+                expected = reader.findMin(query.dim);
+            } else {
+                expected = reader.findMax(query.dim);
+            }
+            same = expected == reader.end() ? results[i] == nullptr : results[i] == &*expected;
+        }
+        CHECK(same);
+    }
+
+    // const iteration and lookups from several threads at once
+    std::vector<std::thread> threads;
+    std::vector<size_t> mismatches(4);
+    for (size_t t = 0; t < mismatches.size(); t++) {
+        threads.emplace_back([&, t]() {
+            size_t count = 0;
+            for (auto it = reader.begin(); it != reader.end(); ++it) {
+                mismatches[t] += model.at(it->first) != it->second;
+                ++count;
+            }
+            mismatches[t] += count != model.size();
+            for (auto& [key, value]: points) {
+                auto it = reader.find(key);
+                mismatches[t] += (it != reader.end()) != (model.count(key) == 1);
+            }
+            mismatches[t] += reader.findMin<0>()->first != reader.findMin(0)->first;
+            mismatches[t] += reader.findMax<1>()->first != reader.findMax(1)->first;
+            for (size_t i = t; i < 200; i += mismatches.size()) {
+                const Point& key = points[i].first;
+                Point lo(std::get<0>(key) - 50, std::get<1>(key) - 50);
+                Point hi(std::get<0>(key) + 50, std::get<1>(key) + 50);
+                size_t inBox = 0, inBall = 0;
+                reader.range(lo, hi, [&](const Tree::Data& data) {
+                    mismatches[t] += model.at(data.first) != data.second;
+                    ++inBox;
+                });
+                mismatches[t] += inBox != reader.rangeCount(lo, hi);
+                reader.withinRadius(key, 50, [&](const Tree::Data&) {
+                    ++inBall;
+                });
+                mismatches[t] += inBall != reader.countWithinRadius(key, 50);
+                auto exact = reader.nearest(key, 5);
+                auto approx = reader.nearestApprox(key, 5, 0);
+                // ties may be broken either way, so the distances are compared, not the keys
+                mismatches[t] += exact.size() != 5 || approx.size() != 5;
+                for (size_t j = 0; j < std::min(exact.size(), approx.size()); j++) {
+                    mismatches[t] += Tree::distance(exact[j]->first, key)
+                                     != Tree::distance(approx[j]->first, key);
+                }
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    for (size_t count: mismatches) {
+        CHECK(count == 0);
+    }
+
+    // keys that can not be ordered along a Morton curve are batched too
+    typedef KDTree<std::tuple<std::string, int>, int> Named;
+    std::vector<std::pair<Named::Key, int>> named;
+    for (int i = 0; i < 1000; i++) {
+        named.push_back({ { std::to_string(i * 7 % 1000), i % 10 }, i });
+    }
+    const Named names(named);
+    std::vector<Named::Query> nameQueries(3000);
+    for (size_t i = 0; i < nameQueries.size(); i++) {
+        nameQueries[i].kind = i % 3 == 0 ? Named::Query::FIND : Named::Query::MIN;
+        nameQueries[i].key = named[random() % named.size()].first;
+        std::get<0>(nameQueries[i].key) += i % 6 == 3 ? "x" : "";
+        nameQueries[i].dim = i % 2;
+    }
+    auto nameResults = names.queryBatch(nameQueries, 2);
+    bool same = true;
+    for (size_t i = 0; i < nameQueries.size(); i++) {
+        auto& query = nameQueries[i];
+        auto expected = query.kind == Named::Query::FIND ? names.find(query.key)
+                                                         : names.findMin(query.dim);
+        same = same && (expected == names.end() ? !nameResults[i] : nameResults[i] == &*expected);
+    }
+    CHECK(same);
+}
+
+/**
+ * @return whether the mapped snapshot answers find and range like the tree
+ */
+bool sameAsMapped(Tree& tree, const MappedKDTree<Point, int>& mapped, std::mt19937& random) {
+    if (mapped.size() != tree.size()) {
+        return false;
+    }
+    for (auto& [key, value]: tree) {
+        const int* found = mapped.find(key);
+        if (!found || *found != value) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < 50; i++) {
+        int x = static_cast<int>(random() % 200) - 100, y = static_cast<int>(random() % 200) - 100;
+        Point lo(x, y);
+        Point hi(x + static_cast<int>(random() % 100), y + static_cast<int>(random() % 100));
+        Model expected, visited;
+        tree.range(lo, hi, [&](Tree::Data& data) {
+            expected[data.first] = data.second;
+        });
+        mapped.range(lo, hi, [&](const Point& key, const int& value) {
+            visited[key] = value;
+        });
+        if (visited != expected || mapped.rangeCount(lo, hi) != expected.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void testSnapshot() {
+    typedef MappedKDTree<Point, int> Mapped;
+    std::string path = (std::filesystem::temp_directory_path() / "kdtree_test.snap").string();
+    std::mt19937 random(2810);
+    auto points = randomPoints(5000, 100, random);
+    Tree tree(points);
+    tree.setTombstoneThreshold(0.9);
+    for (size_t i = 0; i < points.size(); i += 4) {
+        tree.erase(points[i].first);
+    }
+    CHECK(tree.deadSize() > 0);
+    tree.save(path);
+    {
+        Mapped mapped(path);
+        CHECK(sameAsMapped(tree, mapped, random));
+        CHECK(mapped.find(points[0].first) == nullptr);
+    }
+
+    // a path (sorted insertions without rebalancing) is as deep as it is large
+    Tree pathTree;
+    for (int i = 0; i < 10000; i++) {
+        pathTree.insert(Point(i - 5000, i % 200 - 100), i);
+    }
+    pathTree.save(path);
+    {
+        Mapped mapped(path);
+        CHECK(sameAsMapped(pathTree, mapped, random));
+    }
+    Tree().save(path);
+    {
+        Mapped mapped(path);
+        CHECK(mapped.size() == 0 && mapped.find(Point(0, 0)) == nullptr);
+        CHECK(mapped.rangeCount(Point(-1, -1), Point(1, 1)) == 0);
+    }
+
+    // truncated files are rejected at open, corrupt indices when they are read
+    tree.save(path);
+    std::ifstream in(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    auto rejects = [&](const std::string& corrupt, bool query) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << corrupt;
+        try {
+            Mapped mapped(path);
+            if (query) {
+                for (auto& [key, value]: points) {
+                    mapped.find(key);
+                }
+                mapped.rangeCount(Point(-1000, -1000), Point(1000, 1000));
+            }
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    auto& header = *reinterpret_cast<const KDTreeSnapshotHeader*>(bytes.data());
+    CHECK(rejects(bytes.substr(0, sizeof(KDTreeSnapshotHeader) - 1), false));
+    CHECK(rejects(bytes.substr(0, bytes.size() - 1), false));
+    std::string hugeCount = bytes;
+    uint64_t nodeCount = ~uint64_t(0) / 4;
+    std::memcpy(
+        &hugeCount[offsetof(KDTreeSnapshotHeader, nodeCount)], &nodeCount, sizeof(nodeCount)
+    );
+    CHECK(rejects(hugeCount, false));
+    // the root and its left child, which are read by the queries
+    for (uint64_t index: { 0, 1 }) {
+        for (uint64_t value: { header.nodeCount + 1, uint64_t(0), ~uint64_t(0) }) {
+            // the right index of the record, then its end index
+            for (size_t field: { 0, 8 }) {
+                std::string corrupt = bytes;
+                size_t offset = header.recordOffset + index * header.recordSize + field;
+                std::memcpy(&corrupt[offset], &value, sizeof(value));
+                CHECK(rejects(corrupt, true));
+            }
+        }
+    }
+    std::filesystem::remove(path);
+}
+
+int main() {
+    testRebalance();
+    testBuild();
+    testCopy();
+    testTombstones();
+    testNearest();
+    testNearestApprox();
+    testRange();
+    testRadius();
+    testImplicit();
+    testForest();
+    testConcurrentReads();
+    testSnapshot();
+    if (g_failures) {
+        std::cerr << g_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
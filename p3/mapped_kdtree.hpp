@@ -0,0 +1,211 @@
+#pragma once
+
+#include "../common/mapped_file.hpp"
+#include "kdtree.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+/**
+ * An abstract template base of the MappedKDTree class
+ */
+template<typename...>
+class MappedKDTree;
+
+/**
+ * A read-only KDTree served directly from a snapshot written by KDTree::save
+ * Opening maps the file without reading it, nodes are paged in by the queries that reach them
+ * Records are in pre-order, so a subtree inside a query box is a contiguous run of records
+ * The time complexity of functions are based on n and k
+ * n is the size of the tree
+ * k is the number of dimensions
+ * @typedef Key         key type
+ * @typedef Value       value type
+ */
+template<typename ValueType, typename... KeyTypes>
+class MappedKDTree<std::tuple<KeyTypes...>, ValueType> {
+public:
+    typedef std::tuple<KeyTypes...> Key;
+    typedef ValueType Value;
+
+protected:
+    typedef KDTree<Key, Value> Tree;
+    static inline constexpr size_t KeySize = Tree::KeySize;
+    static inline constexpr size_t RecordSize = Tree::RECORD_SIZE;
+
+    MappedFile file;
+    const char* records;
+    size_t treeSize;
+    size_t nodeCount;
+
+    const char* recordAt(uint64_t index) const {
+        return records + index * RecordSize;
+    }
+
+    /**
+     * Read the subtrees of a record: the left one is [index + 1, right), the right one is
+     * [right, end)
+     * Checked on every read rather than at open, so that opening stays O(1); the indices
+     * strictly increase along any descent, so a corrupt file can not loop either
+     * @throw std::runtime_error if the indices are out of range
+     */
+    void childrenOf(uint64_t index, uint64_t& right, uint64_t& end) const {
+        const char* record = recordAt(index);
+        right = Tree::template readRecordField<uint64_t>(record, Tree::RECORD_RIGHT);
+        end = Tree::template readRecordField<uint64_t>(record, Tree::RECORD_END);
+        if (right <= index || right > end || end > nodeCount) {
+            throw std::runtime_error("corrupt kdtree snapshot");
+        }
+    }
+
+    uint64_t countOf(uint64_t index) const {
+        return Tree::template readRecordField<uint64_t>(recordAt(index), Tree::RECORD_COUNT);
+    }
+
+    bool isDead(uint64_t index) const {
+        return Tree::template readRecordField<uint32_t>(recordAt(index), Tree::RECORD_DEAD) != 0;
+    }
+
+    /**
+     * Find the record with key, descending like KDTree::find
+     * Time Complexity: O(k log n)
+     * @return index of the record, or nodeCount if not found
+     */
+    template<size_t DIM>
+    uint64_t find(const Key& key, uint64_t index) const {
+        constexpr size_t DIM_NEXT = (DIM + 1) % KeySize;
+        Key nodeKey = Tree::template readRecordKey<0>(recordAt(index));
+        if (key == nodeKey) {
+            return isDead(index) ? nodeCount : index;
+        }
+        uint64_t right, end;
+        childrenOf(index, right, end);
+        if (Tree::template compareKey<DIM, std::less<>>(key, nodeKey)) {
+            return right > index + 1 ? find<DIM_NEXT>(key, index + 1) : nodeCount;
+        }
+        return end > right ? find<DIM_NEXT>(key, right) : nodeCount;
+    }
+
+    /**
+     * Visit (or count) the live records with a key in [lo, hi] in the subtree of index
+     * A subtree whose box is inside [lo, hi] is scanned as a contiguous run of records
+     * Time Complexity: O(n^(1-1/k) + m)
+     * @tparam Visitor called with (index of record), or nothing if counting only
+     */
+    template<bool COUNT_ONLY, typename Visitor>
+    size_t range(const Key& lo, const Key& hi, uint64_t index, Visitor& visitor) const {
+        const char* record = recordAt(index);
+        size_t count = countOf(index);
+        if (count == 0) {
+            return 0;
+        }
+        Key boxLo = Tree::template readRecordKey<1>(record), boxHi = Tree::template readRecordKey<2>(record);
+        if (!Tree::boxIntersect(boxLo, boxHi, lo, hi)) {
+            return 0;
+        }
+        uint64_t right, end;
+        childrenOf(index, right, end);
+        if (Tree::boxInside(boxLo, boxHi, lo, hi)) {
+            if constexpr (!COUNT_ONLY) {
+                for (uint64_t i = index; i < end; i++) {
+                    if (!isDead(i)) {
+                        visitor(i);
+                    }
+                }
+            }
+            return count;
+        }
+        Key key = Tree::template readRecordKey<0>(record);
+        size_t found = 0;
+        if (!isDead(index) && Tree::boxInside(key, key, lo, hi)) {
+            if constexpr (!COUNT_ONLY) {
+                visitor(index);
+            }
+            found = 1;
+        }
+        if (right > index + 1) {
+            found += range<COUNT_ONLY>(lo, hi, index + 1, visitor);
+        }
+        if (end > right) {
+            found += range<COUNT_ONLY>(lo, hi, right, visitor);
+        }
+        return found;
+    }
+
+public:
+    /**
+     * Map a snapshot, nothing is read besides the header
+     * Time complexity: O(1)
+     * @throw std::runtime_error if the file is not a snapshot of this type
+     * @param path
+     */
+    explicit MappedKDTree(const std::string& path): file(path) {
+        // queries jump between subtrees, read-ahead would mostly load unused pages
+        file.adviseRandom();
+        auto& header = KDTreeSnapshotHeader::check(
+            file.data(), file.size(), sizeof(Key), sizeof(Value), KeySize, RecordSize
+        );
+        records = file.data() + header.recordOffset;
+        treeSize = header.treeSize;
+        nodeCount = header.nodeCount;
+    }
+
+    size_t size() const {
+        return treeSize;
+    }
+
+    /**
+     * Time complexity: O(k log n)
+     * @param key
+     * @return pointer to the value in the mapping, or nullptr if not found
+     */
+    const Value* find(const Key& key) const {
+        if (nodeCount == 0) {
+            return nullptr;
+        }
+        uint64_t index = find<0>(key, 0);
+        if (index == nodeCount) {
+            return nullptr;
+        }
+        return reinterpret_cast<const Value*>(recordAt(index) + Tree::recordField(3 * KeySize));
+    }
+
+    bool contains(const Key& key) const {
+        return find(key) != nullptr;
+    }
+
+    /**
+     * Visit all keys in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k) + m), m is the number of keys in the box
+     * @param visitor called with (const Key&, const Value&) of each key in the box
+     */
+    template<typename Visitor>
+    void range(const Key& lo, const Key& hi, Visitor visitor) const {
+        if (nodeCount == 0) {
+            return;
+        }
+        auto visitRecord = [&](uint64_t index) {
+            const char* record = recordAt(index);
+            visitor(
+                Tree::template readRecordKey<0>(record),
+                *reinterpret_cast<const Value*>(record + Tree::recordField(3 * KeySize))
+            );
+        };
+        range<false>(lo, hi, 0, visitRecord);
+    }
+
+    /**
+     * Count the keys in the box [lo, hi] (bounds included)
+     * Time complexity: O(n^(1-1/k))
+     */
+    size_t rangeCount(const Key& lo, const Key& hi) const {
+        if (nodeCount == 0) {
+            return 0;
+        }
+        auto none = [](uint64_t) {};
+        return range<true>(lo, hi, 0, none);
+    }
+};
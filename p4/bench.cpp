@@ -0,0 +1,207 @@
+// ShortestP2P benchmark: readGraph (Floyd-Warshall in dense mode, the potentials in every
+// mode) and queryBatch throughput, per graph size, density, mode and number of threads
+// usage: ./bench [--vertices=N,N,...] [--degree=N,N,...] [--mode=dense,sparse,auto]
+//                [--threads=N,N,...] [--queries=N] [--seed=N]
+// --degree is the average number of edges leaving a vertex, the graphs have no negative cycle
+// Queries are uniform random pairs, so sparse mode runs about one Dijkstra per vertex, and
+// auto mode turns dense during the batch if that is cheaper
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "shortestP2P.hpp"
+
+struct Options {
+    std::vector<size_t> vertices = { 256, 1024, 2048 };
+    std::vector<size_t> degrees = { 8, 64 };
+    std::vector<std::string> modes = { "dense", "sparse", "auto" };
+    std::vector<size_t> threads = { 1, 2, 4, 8 };
+    size_t queries = 1000000;
+    uint64_t seed = 2810;
+};
+
+// results of the timed loops are stored here, so that the loops are not optimized out
+static volatile long long g_sink = 0;
+
+/**
+ * A random graph in the input format of readGraph, w(u, v) = p(v) - p(u) + a non-negative cost,
+ * so that about half of the weights are negative and there is no negative cycle
+ */
+std::string generate(size_t vertices, size_t edges, std::mt19937_64& random) {
+    std::vector<int> potential(vertices);
+    for (int& p: potential) {
+        p = static_cast<int>(random() % 1000);
+    }
+    std::ostringstream out;
+    out << vertices << "\n" << edges << "\n";
+    for (size_t e = 0; e < edges; e++) {
+        size_t u = random() % vertices, v = random() % vertices;
+        out << u << " " << v << " " << static_cast<int>(random() % 500) + potential[v] - potential[u]
+            << "\n";
+    }
+    return out.str();
+}
+
+/**
+ * @return the seconds taken by f
+ */
+template<typename F>
+double measure(F f) {
+    typedef std::chrono::steady_clock Clock;
+    auto start = Clock::now();
+    f();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+ShortestP2P::Mode parseMode(const std::string& mode) {
+    return mode == "dense" ? ShortestP2P::DENSE : mode == "sparse" ? ShortestP2P::SPARSE : ShortestP2P::AUTO;
+}
+
+void run(const Options& options, size_t vertices, size_t degree, const std::string& mode) {
+    std::mt19937_64 random(options.seed);
+    std::string input = generate(vertices, vertices * degree, random);
+    std::vector<std::pair<unsigned int, unsigned int>> queries(options.queries);
+    for (auto& [a, b]: queries) {
+        a = static_cast<unsigned int>(random() % vertices);
+        b = static_cast<unsigned int>(random() % vertices);
+    }
+    for (size_t threads: options.threads) {
+        ShortestP2P solver(threads, parseMode(mode));
+        std::istringstream in(input);
+        auto buffer = std::cin.rdbuf(in.rdbuf());
+        double readSeconds = measure([&]() {
+            solver.readGraph();
+        });
+        std::cin.rdbuf(buffer);
+        double querySeconds = measure([&]() {
+            long long sum = 0;
+            for (int d: solver.queryBatch(queries)) {
+                sum += d;
+            }
+            g_sink = sum;
+        });
+        std::cout << std::setw(8) << vertices << std::setw(8) << degree << "  " << std::left << std::setw(8)
+                  << mode << std::setw(7) << (solver.getMode() == ShortestP2P::DENSE ? "dense" : "sparse")
+                  << std::right << std::setw(8) << threads << std::setw(12) << std::fixed << std::setprecision(1)
+                  << readSeconds * 1e3 << std::setw(12) << std::setprecision(2)
+                  << static_cast<double>(queries.size()) / querySeconds / 1e6 << std::endl;
+    }
+}
+
+/**
+ * Parse the whole of value into result
+ * @return false if value is not a number of type T, signs are rejected for unsigned types
+ */
+template<typename T>
+bool parse(const std::string& value, T& result) {
+    if (std::is_unsigned<T>::value && value.find('-') != std::string::npos) {
+        return false;
+    }
+    std::istringstream in(value);
+    return in >> result && (in >> std::ws).eof();
+}
+
+/**
+ * Parse a comma separated list of numbers into result
+ * @return false if any of them is not a number of type T
+ */
+template<typename T>
+bool parseList(const std::string& value, std::vector<T>& result) {
+    result.clear();
+    std::istringstream in(value);
+    for (std::string item; std::getline(in, item, ',');) {
+        result.push_back(T());
+        if (!parse(item, result.back())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        bool valid = true;
+        if (name == "--vertices") {
+            valid = parseList(value, options.vertices);
+        } else if (name == "--degree") {
+            valid = parseList(value, options.degrees);
+        } else if (name == "--mode") {
+            options.modes.clear();
+            std::istringstream in(value);
+            for (std::string mode; std::getline(in, mode, ',');) {
+                options.modes.push_back(mode);
+            }
+        } else if (name == "--threads") {
+            valid = parseList(value, options.threads);
+        } else if (name == "--queries") {
+            valid = parse(value, options.queries);
+        } else if (name == "--seed") {
+            valid = parse(value, options.seed);
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+        if (!valid) {
+            std::cerr << "invalid value in " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (options.vertices.empty() || options.degrees.empty() || options.modes.empty()
+        || options.threads.empty()) {
+        std::cerr << "--vertices, --degree, --mode and --threads must not be empty" << std::endl;
+        return 1;
+    }
+    for (size_t vertices: options.vertices) {
+        // vertices are unsigned int, and a dense matrix above this does not fit in memory
+        if (vertices == 0 || vertices > ShortestP2P::MAX_DENSE_VERTICES) {
+            std::cerr << "--vertices must be in [1, " << ShortestP2P::MAX_DENSE_VERTICES << "]" << std::endl;
+            return 1;
+        }
+    }
+    for (size_t degree: options.degrees) {
+        if (degree == 0) {
+            std::cerr << "--degree must be positive" << std::endl;
+            return 1;
+        }
+    }
+    for (auto& mode: options.modes) {
+        if (mode != "dense" && mode != "sparse" && mode != "auto") {
+            std::cerr << "unknown mode " << mode << std::endl;
+            return 1;
+        }
+    }
+    for (size_t threads: options.threads) {
+        if (threads == 0) {
+            std::cerr << "--threads must be positive" << std::endl;
+            return 1;
+        }
+    }
+    if (options.queries == 0) {
+        std::cerr << "--queries must be positive" << std::endl;
+        return 1;
+    }
+
+    std::cout << options.queries << " queries per batch" << std::endl;
+    std::cout << std::setw(8) << "V" << std::setw(8) << "degree" << "  " << std::left << std::setw(8) << "mode"
+              << std::setw(7) << "as" << std::right << std::setw(8) << "threads" << std::setw(12) << "read ms"
+              << std::setw(12) << "Mq/s" << std::endl;
+    for (size_t vertices: options.vertices) {
+        for (size_t degree: options.degrees) {
+            for (auto& mode: options.modes) {
+                run(options, vertices, degree, mode);
+            }
+        }
+    }
+    return 0;
+}
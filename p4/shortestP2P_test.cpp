@@ -0,0 +1,506 @@
+// Behaviour tests of ShortestP2P against a Floyd-Warshall reference, exits with a non-zero
+// status if any check fails
+// build: g++ -std=c++17 -O2 -pthread -o shortestP2P_test shortestP2P_test.cpp
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "shortestP2P.hpp"
+
+static size_t g_failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition     \
+                      << std::endl;                                                       \
+            ++g_failures;                                                                 \
+        }                                                                                 \
+    } while (false)
+
+typedef std::map<std::pair<unsigned int, unsigned int>, int> EdgeMap; // the last edge wins
+typedef std::vector<std::vector<long long>> Reference;
+
+const long long UNREACHABLE = LLONG_MAX;
+
+/**
+ * All-pairs distances of the edges in long long, so that nothing saturates
+ * @param negative set to whether there is a negative cycle
+ */
+Reference floydWarshall(size_t n, const EdgeMap& edges, bool& negative) {
+    Reference d(n, std::vector<long long>(n, UNREACHABLE));
+    for (auto& [pair, w]: edges) {
+        d[pair.first][pair.second] = w;
+    }
+    for (size_t i = 0; i < n; i++) {
+        d[i][i] = 0;
+    }
+    for (size_t k = 0; k < n; k++) {
+        for (size_t i = 0; i < n; i++) {
+            if (d[i][k] == UNREACHABLE) {
+                continue;
+            }
+            for (size_t j = 0; j < n; j++) {
+                if (d[k][j] != UNREACHABLE && d[i][k] + d[k][j] < d[i][j]) {
+                    // clamped, so that a negative cycle can not overflow
+                    d[i][j] = std::max(d[i][k] + d[k][j], -(1ll << 40));
+                }
+            }
+        }
+    }
+    negative = false;
+    for (size_t i = 0; i < n; i++) {
+        negative = negative || d[i][i] < 0;
+    }
+    return d;
+}
+
+/**
+ * A random graph without negative cycle: w(u, v) = p(v) - p(u) + a non-negative cost, so that
+ * about half of the weights are negative
+ * @param input set to the graph in the input format of readGraph, duplicates and self-loops
+ * included
+ */
+EdgeMap randomGraph(size_t n, size_t m, std::mt19937& random, std::string& input) {
+    std::vector<int> potential(n);
+    for (int& p: potential) {
+        p = static_cast<int>(random() % 100);
+    }
+    EdgeMap edges;
+    std::ostringstream out;
+    out << n << "\n" << m << "\n";
+    for (size_t e = 0; e < m; e++) {
+        unsigned int u = random() % n, v = random() % n;
+        int w = static_cast<int>(random() % 50) + potential[v] - potential[u];
+        out << u << " " << v << " " << w << "\n";
+        if (u != v) {
+            edges[{ u, v }] = w;
+        }
+    }
+    input = out.str();
+    return edges;
+}
+
+void readFrom(ShortestP2P& solver, const std::string& input) {
+    std::istringstream in(input);
+    auto buffer = std::cin.rdbuf(in.rdbuf());
+    solver.readGraph();
+    std::cin.rdbuf(buffer);
+}
+
+/**
+ * @return the line printed by distance
+ */
+std::string printed(ShortestP2P& solver, unsigned int a, unsigned int b) {
+    std::ostringstream out;
+    auto buffer = std::cout.rdbuf(out.rdbuf());
+    solver.distance(a, b);
+    std::cout.rdbuf(buffer);
+    return out.str();
+}
+
+std::string expected(const Reference& d, unsigned int a, unsigned int b) {
+    return (d[a][b] == UNREACHABLE ? "INF" : std::to_string(d[a][b])) + "\n";
+}
+
+/**
+ * @return whether distance (for a few random pairs) and queryBatch (for all pairs) agree with
+ * the reference
+ */
+bool sameDistances(ShortestP2P& solver, const Reference& d, std::mt19937& random) {
+    unsigned int n = static_cast<unsigned int>(d.size());
+    for (size_t q = 0; q < 10; q++) {
+        unsigned int a = random() % n, b = random() % n;
+        if (printed(solver, a, b) != expected(d, a, b)) {
+            return false;
+        }
+    }
+    std::vector<std::pair<unsigned int, unsigned int>> pairs;
+    for (unsigned int a = 0; a < n; a++) {
+        for (unsigned int b = 0; b < n; b++) {
+            pairs.push_back({ a, b });
+        }
+    }
+    auto answers = solver.queryBatch(pairs);
+    for (size_t q = 0; q < pairs.size(); q++) {
+        long long want = d[pairs[q].first][pairs[q].second];
+        if (answers[q] != (want == UNREACHABLE ? INF : want)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void testModes() {
+    std::mt19937 random(2810);
+    for (size_t iteration = 0; iteration < 60; iteration++) {
+        size_t n = random() % 60 + 1, m = random() % (n * (iteration % 2 ? 2 : n)) + 1;
+        std::string input;
+        EdgeMap edges = randomGraph(n, m, random, input);
+        bool negative;
+        Reference d = floydWarshall(n, edges, negative);
+        CHECK(!negative);
+        for (auto mode: { ShortestP2P::AUTO, ShortestP2P::DENSE, ShortestP2P::SPARSE }) {
+            ShortestP2P solver(random() % 3 + 1, mode);
+            readFrom(solver, input);
+            auto initial = mode == ShortestP2P::DENSE ? ShortestP2P::DENSE : ShortestP2P::SPARSE;
+            CHECK(solver.getMode() == initial);
+            CHECK(sameDistances(solver, d, random));
+            if (mode == ShortestP2P::SPARSE) {
+                CHECK(solver.getMode() == ShortestP2P::SPARSE);
+            }
+        }
+    }
+
+    // AUTO turns dense once the sources queried cost as much as Floyd-Warshall, a dense graph
+    // after a few sources, a large sparse graph never
+    std::string input;
+    EdgeMap edges = randomGraph(64, 64 * 64, random, input);
+    bool negative;
+    Reference d = floydWarshall(64, edges, negative);
+    ShortestP2P solver(2, ShortestP2P::AUTO);
+    readFrom(solver, input);
+    CHECK(solver.getMode() == ShortestP2P::SPARSE);
+    for (unsigned int a = 0; a < 64; a++) {
+        CHECK(printed(solver, a, 63 - a) == expected(d, a, 63 - a));
+    }
+    CHECK(solver.getMode() == ShortestP2P::DENSE);
+    CHECK(sameDistances(solver, d, random));
+
+    std::ostringstream chain;
+    chain << 5000 << "\n" << 4999 << "\n";
+    for (unsigned int v = 0; v + 1 < 5000; v++) {
+        chain << v << " " << v + 1 << " " << (v % 2 ? -1 : 2) << "\n";
+    }
+    ShortestP2P sparse(2, ShortestP2P::AUTO);
+    readFrom(sparse, chain.str());
+    std::vector<long long> toEnd(5000); // distance from v to 4999 along the chain
+    for (unsigned int v = 4999; v-- > 0;) {
+        toEnd[v] = toEnd[v + 1] + (v % 2 ? -1 : 2);
+    }
+    for (unsigned int a = 0; a < 5000; a += 50) {
+        CHECK(printed(sparse, a, 4999) == std::to_string(toEnd[a]) + "\n");
+        CHECK(printed(sparse, 4999, a) == (a == 4999 ? "0\n" : "INF\n"));
+    }
+    CHECK(sparse.getMode() == ShortestP2P::SPARSE);
+}
+
+/**
+ * @return row after relaxing it through ik + rowK, computed in long long and clamped to
+ * [-INF, INF], INF entries of rowK relax nothing
+ */
+std::vector<int> relaxed(std::vector<int> row, int ik, const std::vector<int>& rowK) {
+    for (size_t j = 0; j < row.size(); j++) {
+        if (rowK[j] != INF) {
+            long long sum = std::max<long long>(static_cast<long long>(ik) + rowK[j], -INF);
+            row[j] = static_cast<int>(std::min<long long>(row[j], sum));
+        }
+    }
+    return row;
+}
+
+void testKernels() {
+    std::mt19937 random(2810);
+    std::vector<MinPlus::RowKernel> kernels { MinPlus::Scalar::relax };
+#ifdef MIN_PLUS_X86
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(MinPlus::Avx2::relax);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(MinPlus::Avx512::relax);
+    }
+#endif
+    const int special[] = { INF, -INF, 0, 1, -1, INF - 1, -INF + 1 };
+    auto randomEntry = [&]() {
+        switch (random() % 4) {
+            case 0:
+                return special[random() % 7];
+            case 1:
+                return static_cast<int>(random() % 201) - 100;
+            default:
+                return static_cast<int>(random());
+        }
+    };
+    bool same = true;
+    // every length up to past a vector of 64 lanes, so that all the tails are run
+    for (size_t n = 0; n <= 70; n++) {
+        for (size_t trial = 0; trial < 50; trial++) {
+            std::vector<int> rowI(n), rowK(n);
+            for (size_t j = 0; j < n; j++) {
+                rowI[j] = randomEntry();
+                rowK[j] = randomEntry();
+            }
+            int ik = trial < 6 ? special[trial + 1] : randomEntry();
+            if (ik == INF) {
+                continue;
+            }
+            std::vector<int> expected = relaxed(rowI, ik, rowK);
+            for (auto kernel: kernels) {
+                std::vector<int> row = rowI;
+                kernel(row.data(), ik, rowK.data(), n);
+                same = same && row == expected;
+            }
+        }
+    }
+    CHECK(same);
+
+    // an input weight of INT_MIN saturates to -INF like a distance below it, in every mode
+    for (auto mode: { ShortestP2P::DENSE, ShortestP2P::SPARSE }) {
+        ShortestP2P solver(1, mode);
+        readFrom(solver, "3\n2\n0 1 -2147483648\n1 2 5\n");
+        CHECK(printed(solver, 0, 1) == std::to_string(-INF) + "\n");
+        CHECK(printed(solver, 0, 2) == std::to_string(-INF + 5) + "\n");
+        CHECK(solver.updateEdge(1, 2, INT_MIN));
+        CHECK(printed(solver, 0, 2) == std::to_string(-INF) + "\n");
+        CHECK(printed(solver, 1, 2) == std::to_string(-INF) + "\n");
+    }
+}
+
+void testTiles() {
+    std::mt19937 random(2810);
+    // several 64 x 64 tiles, the last one partly padded unless V is a multiple of the tile
+    for (size_t n: { 65, 128, 130, 200, 257 }) {
+        for (size_t m: { 3 * n, n * n / 2 }) {
+            std::string input;
+            EdgeMap edges = randomGraph(n, m, random, input);
+            bool negative;
+            Reference d = floydWarshall(n, edges, negative);
+            for (size_t threads: { 1, 3, 8 }) {
+                ShortestP2P dense(threads, ShortestP2P::DENSE);
+                readFrom(dense, input);
+                CHECK(dense.getMode() == ShortestP2P::DENSE);
+                CHECK(sameDistances(dense, d, random));
+            }
+            // a dense graph turns dense within the batch of all sources
+            ShortestP2P automatic(3, ShortestP2P::AUTO);
+            readFrom(automatic, input);
+            CHECK(sameDistances(automatic, d, random));
+            CHECK(m < n * n / 2 || automatic.getMode() == ShortestP2P::DENSE);
+        }
+    }
+
+    // updates of a multi-tile matrix, including those that run Floyd-Warshall again
+    std::string input;
+    EdgeMap edges = randomGraph(130, 2000, random, input);
+    ShortestP2P solver(3, ShortestP2P::DENSE);
+    readFrom(solver, input);
+    bool same = true;
+    for (size_t step = 0; step < 20 && same; step++) {
+        unsigned int u = random() % 130, v = random() % 130;
+        auto it = edges.find({ u, v });
+        // increases of existing edges, and new edges of any sign
+        int w = it != edges.end() && step % 2 ? it->second + static_cast<int>(random() % 100)
+                                              : static_cast<int>(random() % 100) - 30;
+        EdgeMap updated = edges;
+        if (u != v) {
+            updated[{ u, v }] = w;
+        }
+        bool negative;
+        Reference d = floydWarshall(130, updated, negative);
+        bool accepted = solver.updateEdge(u, v, w);
+        same = accepted != negative;
+        if (accepted) {
+            edges = updated;
+            same = same && sameDistances(solver, d, random);
+        }
+    }
+    CHECK(same);
+}
+
+void testThreads() {
+    std::mt19937 random(2810);
+    // a multi-tile dense graph and a sparse one with unreachable pairs, in every mode
+    for (size_t m: { 200 * 100, 200 * 2 }) {
+        std::string input;
+        randomGraph(200, m, random, input);
+        std::vector<std::pair<unsigned int, unsigned int>> pairs;
+        for (unsigned int a = 0; a < 200; a++) {
+            for (unsigned int b = 0; b < 200; b++) {
+                pairs.push_back({ a, b });
+            }
+        }
+        std::shuffle(pairs.begin(), pairs.end(), random);
+        for (auto mode: { ShortestP2P::DENSE, ShortestP2P::SPARSE, ShortestP2P::AUTO }) {
+            std::vector<int> first;
+            for (size_t threads: { 1, 2, 3, 8 }) {
+                ShortestP2P solver(threads, mode);
+                readFrom(solver, input);
+                auto answers = solver.queryBatch(pairs);
+                if (threads == 1) {
+                    first = answers;
+                }
+                CHECK(answers == first);
+            }
+        }
+    }
+}
+
+void testCache() {
+    std::mt19937 random(2810);
+    std::string input;
+    EdgeMap edges = randomGraph(200, 1000, random, input);
+    bool negative;
+    Reference d = floydWarshall(200, edges, negative);
+    // a budget below one row still caches one row, a large one caches every source
+    size_t row = 200 * sizeof(int);
+    for (size_t budget: { size_t(1), 10 * row, ShortestP2P::DEFAULT_CACHE_BUDGET }) {
+        ShortestP2P solver(2, ShortestP2P::SPARSE);
+        solver.setCacheBudget(budget);
+        CHECK(solver.getCacheBudget() == budget);
+        readFrom(solver, input);
+        bool same = true;
+        for (size_t q = 0; q < 2000 && same; q++) {
+            // a few hot sources, and many cold ones
+            unsigned int a = q % 3 ? random() % 8 : random() % 200, b = random() % 200;
+            same = printed(solver, a, b) == expected(d, a, b);
+        }
+        CHECK(same);
+        CHECK(sameDistances(solver, d, random));
+    }
+}
+
+void testNegativeCycle() {
+    std::mt19937 random(2810);
+    for (size_t iteration = 0; iteration < 200; iteration++) {
+        size_t n = random() % 40 + 2, m = random() % (4 * n) + 1;
+        std::string input;
+        EdgeMap edges = randomGraph(n, m, random, input);
+        bool plant = iteration % 2;
+        if (plant) {
+            // a cycle through up to 4 random vertices, with a negative total weight
+            unsigned int length = random() % 4 + 2;
+            std::vector<unsigned int> cycle;
+            for (unsigned int i = 0; i < length; i++) {
+                cycle.push_back(random() % n);
+            }
+            for (unsigned int i = 0; i < length; i++) {
+                unsigned int u = cycle[i], v = cycle[(i + 1) % length];
+                if (u != v) {
+                    edges[{ u, v }] = -static_cast<int>(random() % 200) - 1;
+                }
+            }
+        }
+        bool negative;
+        floydWarshall(n, edges, negative);
+        std::vector<SparseGraph::Edge> list;
+        for (auto& [pair, w]: edges) {
+            list.push_back({ pair.first, pair.second, w });
+        }
+        SparseGraph graph(n, list);
+        auto cycle = ShortestP2P::negativeCycle(graph);
+        CHECK(cycle.empty() != negative);
+        // the cycle returned is made of edges of the graph, with a negative total weight
+        long long total = 0;
+        bool closed = true;
+        for (size_t i = 0; i < cycle.size(); i++) {
+            auto it = edges.find({ cycle[i], cycle[(i + 1) % cycle.size()] });
+            closed = closed && it != edges.end();
+            total += it != edges.end() ? it->second : 0;
+        }
+        CHECK(closed && (cycle.empty() || total < 0));
+    }
+}
+
+void testUpdateEdge() {
+    std::mt19937 random(2810);
+    size_t rejected = 0;
+    for (size_t iteration = 0; iteration < 60; iteration++) {
+        size_t n = random() % 40 + 2, m = random() % (n * (iteration % 2 ? 2 : n / 2 + 1)) + 1;
+        std::string input;
+        EdgeMap edges = randomGraph(n, m, random, input);
+        bool negative;
+        Reference d = floydWarshall(n, edges, negative);
+        auto mode = static_cast<ShortestP2P::Mode>(iteration % 3);
+        ShortestP2P solver(random() % 3 + 1, mode);
+        if (iteration % 2) {
+            // caching only one row drops the rows relaxed by an update
+            solver.setCacheBudget(1);
+        }
+        readFrom(solver, input);
+        bool same = true;
+        for (size_t step = 0; step < 30 && same; step++) {
+            unsigned int u = random() % n, v = random() % n;
+            auto it = edges.find({ u, v });
+            int w;
+            switch (it == edges.end() ? 2 : random() % 3) {
+                case 0: // increase
+                    w = it->second + static_cast<int>(random() % 40);
+                    break;
+                case 1: // decrease, possibly closing a negative cycle
+                    w = it->second - static_cast<int>(random() % 40);
+                    break;
+                default: // a new edge, or an arbitrary weight
+                    w = static_cast<int>(random() % 100) - 50;
+            }
+            EdgeMap updated = edges;
+            if (u != v) {
+                updated[{ u, v }] = w;
+            }
+            bool updatedNegative;
+            Reference updatedDistances = floydWarshall(n, updated, updatedNegative);
+            bool accepted = solver.updateEdge(u, v, w);
+            same = accepted != updatedNegative;
+            if (accepted) {
+                edges = updated;
+                d = updatedDistances;
+            } else {
+                ++rejected;
+            }
+            // a rejected update leaves the distances unchanged
+            same = same && sameDistances(solver, d, random);
+        }
+        CHECK(same);
+    }
+    CHECK(rejected > 0);
+
+    // updates before readGraph and with a vertex out of range are rejected
+    for (auto mode: { ShortestP2P::AUTO, ShortestP2P::DENSE, ShortestP2P::SPARSE }) {
+        ShortestP2P solver(2, mode);
+        CHECK(!solver.updateEdge(0, 1, 5));
+        CHECK(!solver.updateEdge(0, 0, 5));
+        readFrom(solver, "3\n1\n0 1 5\n");
+        CHECK(!solver.updateEdge(0, 3, 1));
+        CHECK(!solver.updateEdge(3, 0, 1));
+        CHECK(!solver.updateEdge(3, 3, 1));
+        CHECK(printed(solver, 0, 1) == "5\n" && printed(solver, 1, 2) == "INF\n");
+    }
+
+    // a sparse graph made dense by updates turns dense like one read dense
+    const size_t n = 64;
+    ShortestP2P solver(2, ShortestP2P::AUTO);
+    readFrom(solver, "64\n1\n0 1 5\n");
+    EdgeMap edges { { { 0, 1 }, 5 } };
+    for (unsigned int u = 0; u < n; u++) {
+        for (unsigned int v = 0; v < n; v++) {
+            if (u != v) {
+                int w = static_cast<int>(random() % 100);
+                CHECK(solver.updateEdge(u, v, w));
+                edges[{ u, v }] = w;
+            }
+        }
+    }
+    CHECK(solver.getMode() == ShortestP2P::SPARSE);
+    bool negative;
+    Reference d = floydWarshall(n, edges, negative);
+    CHECK(sameDistances(solver, d, random));
+    CHECK(solver.getMode() == ShortestP2P::DENSE);
+}
+
+int main() {
+    testModes();
+    testKernels();
+    testTiles();
+    testThreads();
+    testCache();
+    testNegativeCycle();
+    testUpdateEdge();
+    if (g_failures) {
+        std::cerr << g_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}